@@ -0,0 +1,433 @@
+/* Benchmark driver for the posix-regex extension module.
+
+   usage: bench-regexp [-f flags] [-m max-size] [-t seconds] module
+
+   The module is loaded with dlopen() and registered with libxslt.  Each
+   function is exercised by applying a small stylesheet to generated
+   documents from 1 KB up to max-size bytes, calling the function once per
+   item, or once for all of the items for a warm filter(), either with a
+   single pattern which remains in the module's cache (warm) or with a
+   different pattern for every call (cold).  For each case the time and
+   number of allocations per item and the peak resident set size are
+   reported.  flags are passed to every call, for example "l" to benchmark
+   the linear time matcher. */
+
+#include <libxml/globals.h>
+#include <libxml/tree.h>
+#include <libxml/parser.h>
+#include <libxml/xmlmemory.h>
+#include <libxslt/xsltconfig.h>
+#include <libxslt/xsltInternals.h>
+#include <libxslt/transform.h>
+#include <libxslt/xsltutils.h>
+#include <dlfcn.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#define MODULE_INIT	"iarthair_github_io_posix_regex_init"
+#define MAX_SIZE	(100L * 1024 * 1024)
+#define MIN_TIME	0.5	/* seconds each case is repeated for */
+
+/****************************************************************************
+ * Allocation counting
+ *
+ * With the GNU C library malloc() is replaced so that allocations made by
+ * the C library, such as those of regcomp() and regexec(), are counted
+ * along with those of libxml2, libxslt and the module.  Elsewhere only
+ * allocations through xmlMalloc() are counted.
+ ****************************************************************************/
+
+static atomic_ulong nalloc;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void __libc_free (void *ptr);
+
+void *
+malloc (size_t size)
+{
+  atomic_fetch_add_explicit (&nalloc, 1, memory_order_relaxed);
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+  atomic_fetch_add_explicit (&nalloc, 1, memory_order_relaxed);
+  return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+  atomic_fetch_add_explicit (&nalloc, 1, memory_order_relaxed);
+  return __libc_realloc (ptr, size);
+}
+
+void
+free (void *ptr)
+{
+  __libc_free (ptr);
+}
+#else
+static void *
+count_malloc (size_t size)
+{
+  atomic_fetch_add_explicit (&nalloc, 1, memory_order_relaxed);
+  return malloc (size);
+}
+
+static void *
+count_realloc (void *ptr, size_t size)
+{
+  atomic_fetch_add_explicit (&nalloc, 1, memory_order_relaxed);
+  return realloc (ptr, size);
+}
+
+static char *
+count_strdup (const char *str)
+{
+  atomic_fetch_add_explicit (&nalloc, 1, memory_order_relaxed);
+  return strdup (str);
+}
+#endif
+
+/* Reset the peak resident set size where the kernel allows it */
+static void
+reset_peak_rss (void)
+{
+  FILE *fp;
+
+  if ((fp = fopen ("/proc/self/clear_refs", "w")) != NULL)
+    {
+      fputs ("5", fp);
+      fclose (fp);
+    }
+}
+
+/* Peak resident set size in KB */
+static long
+peak_rss (void)
+{
+  struct rusage usage;
+  char line[128];
+  FILE *fp;
+  long kb;
+
+  if ((fp = fopen ("/proc/self/status", "r")) != NULL)
+    {
+      while (fgets (line, sizeof line, fp) != NULL)
+	if (sscanf (line, "VmHWM: %ld", &kb) == 1)
+	  {
+	    fclose (fp);
+	    return kb;
+	  }
+      fclose (fp);
+    }
+  getrusage (RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/****************************************************************************
+ * Documents
+ ****************************************************************************/
+
+static const char *const words[] =
+  {
+    "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel",
+    "india", "juliet", "kilo", "lima", "mike", "november", "oscar", "papa",
+    "quebec", "romeo", "sierra", "tango", "uniform", "victor", "whiskey",
+    "xray", "yankee", "zulu", "café", "naïve", "Zürich", "résumé",
+  };
+
+#define NWORDS	(sizeof words / sizeof words[0])
+
+static unsigned long seed;
+
+static unsigned long
+rnd (unsigned long n)
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 16) % n;
+}
+
+/* Generate a document of about size bytes of text in <item> elements,
+   each a line of words, numbers and e-mail addresses */
+static xmlDoc *
+make_doc (long size, long *nitems)
+{
+  xmlDoc *doc;
+  xmlNode *root;
+  char text[512];
+  int len, n, i;
+  long total;
+
+  seed = 1;
+  doc = xmlNewDoc (BAD_CAST "1.0");
+  root = xmlNewDocNode (doc, NULL, BAD_CAST "doc", NULL);
+  xmlDocSetRootElement (doc, root);
+  *nitems = 0;
+  for (total = 0; total < size; total += len)
+    {
+      n = 6 + rnd (10);
+      len = 0;
+      for (i = 0; i < n; i++)
+	switch (rnd (8))
+	  {
+	  case 0:
+	    len += snprintf (text + len, sizeof text - len, "%s%lu",
+			     i > 0 ? " " : "", rnd (100000));
+	    break;
+	  case 1:
+	    len += snprintf (text + len, sizeof text - len, "%s%s@example.com",
+			     i > 0 ? " " : "", words[rnd (NWORDS)]);
+	    break;
+	  default:
+	    len += snprintf (text + len, sizeof text - len, "%s%s",
+			     i > 0 ? " " : "", words[rnd (NWORDS)]);
+	    break;
+	  }
+      xmlNewTextChild (root, NULL, BAD_CAST "item", BAD_CAST text);
+      (*nitems)++;
+    }
+  return doc;
+}
+
+/****************************************************************************
+ * Stylesheets
+ *
+ * Each operation calls a function once per item, except a warm filter()
+ * which is passed all of the items in one call.  Cold patterns add an
+ * alternative which never matches and is different for every call so
+ * that the pattern is always compiled.
+ ****************************************************************************/
+
+#define NUMBER	"'[0-9]+'"
+#define EMAIL	"'[a-z]+@example\\.com'"
+#define UNIQUE(p) "concat(" p ", '|zq', position())"
+
+struct op
+  {
+    const char *name;
+    const char *warm, *cold;
+  };
+
+static const struct op ops[] =
+  {
+    {
+      "replace",
+      "<xsl:for-each select='/doc/item'>"
+      "<xsl:value-of select=\"re:replace(., " NUMBER ", concat('g', $f), '#')\"/>"
+      "</xsl:for-each>",
+      "<xsl:for-each select='/doc/item'>"
+      "<xsl:value-of select=\"re:replace(., " UNIQUE (NUMBER) ", concat('g', $f), '#')\"/>"
+      "</xsl:for-each>",
+    },
+    {
+      "match",
+      "<xsl:for-each select='/doc/item'>"
+      "<xsl:value-of select=\"count(re:match(., " EMAIL ", concat('g', $f)))\"/>"
+      "</xsl:for-each>",
+      "<xsl:for-each select='/doc/item'>"
+      "<xsl:value-of select=\"count(re:match(., " UNIQUE (EMAIL) ", concat('g', $f)))\"/>"
+      "</xsl:for-each>",
+    },
+    {
+      "test",
+      "<xsl:value-of select=\"count(/doc/item[re:test(., " EMAIL ", $f)])\"/>",
+      "<xsl:value-of select=\"count(/doc/item[re:test(., " UNIQUE (EMAIL) ", $f)])\"/>",
+    },
+    {
+      "filter",
+      "<xsl:value-of select=\"count(re:filter(/doc/item, " EMAIL ", $f))\"/>",
+      "<xsl:for-each select='/doc/item'>"
+      "<xsl:value-of select=\"count(re:filter(., " UNIQUE (EMAIL) ", $f))\"/>"
+      "</xsl:for-each>",
+    },
+  };
+
+static xsltStylesheet *
+make_style (const char *body, const char *flags)
+{
+  static const char format[] =
+    "<xsl:stylesheet version='1.0'"
+    " xmlns:xsl='http://www.w3.org/1999/XSL/Transform'"
+    " xmlns:re='https://iarthair.github.io/posix-regex'>"
+    "<xsl:variable name='f' select=\"'%s'\"/>"
+    "<xsl:template match='/'><out>%s</out></xsl:template>"
+    "</xsl:stylesheet>";
+  xsltStylesheet *style;
+  xmlDoc *doc;
+  char *text;
+  int len;
+
+  len = snprintf (NULL, 0, format, flags, body);
+  if ((text = malloc (len + 1)) == NULL)
+    return NULL;
+  snprintf (text, len + 1, format, flags, body);
+  doc = xmlReadMemory (text, len, "bench.xsl", NULL, 0);
+  free (text);
+  if (doc == NULL)
+    return NULL;
+  if ((style = xsltParseStylesheetDoc (doc)) == NULL)
+    xmlFreeDoc (doc);
+  return style;
+}
+
+/****************************************************************************
+ * Driver
+ ****************************************************************************/
+
+static const long sizes[] =
+  {
+    1024L, 10 * 1024L, 100 * 1024L,
+    1024 * 1024L, 10 * 1024 * 1024L, 100 * 1024 * 1024L,
+  };
+
+static void
+size_name (char *buf, size_t len, long size)
+{
+  if (size >= 1024 * 1024)
+    snprintf (buf, len, "%ldM", size / (1024 * 1024));
+  else
+    snprintf (buf, len, "%ldK", size / 1024);
+}
+
+/* Apply the stylesheet repeatedly for at least min_time seconds and report
+   the time and allocations per item, whether the function is called for
+   each item or once for all of them */
+static int
+run_case (const char *name, const char *variant, xsltStylesheet *style,
+	  xmlDoc *doc, long size, long nitems, double min_time)
+{
+  xmlDoc *res;
+  unsigned long allocs;
+  double start, elapsed;
+  long runs;
+  char sz[24];
+
+  reset_peak_rss ();
+  atomic_store (&nalloc, 0);
+  runs = 0;
+  start = now ();
+  do
+    {
+      if ((res = xsltApplyStylesheet (style, doc, NULL)) == NULL)
+	return -1;
+      xmlFreeDoc (res);
+      runs++;
+      elapsed = now () - start;
+    }
+  while (elapsed < min_time);
+  allocs = atomic_load (&nalloc);
+
+  size_name (sz, sizeof sz, size);
+  printf ("%-8s %-5s %6s %9ld %10.1f %11.2f %9ldK\n", name, variant, sz,
+	  runs * nitems, elapsed * 1e9 / (runs * nitems),
+	  (double) allocs / (runs * nitems), peak_rss ());
+  fflush (stdout);
+  return 0;
+}
+
+static void
+usage (const char *prog)
+{
+  fprintf (stderr, "usage: %s [-f flags] [-m max-size] [-t seconds] module\n",
+	   prog);
+  exit (2);
+}
+
+int
+main (int argc, char **argv)
+{
+  xsltStylesheet *style[2];
+  const char *flags;
+  void *module;
+  void (*init) (void);
+  xmlDoc *doc;
+  double min_time;
+  long max_size, size, nitems;
+  size_t i, k;
+  int opt, j, status;
+
+  flags = "";
+  max_size = MAX_SIZE;
+  min_time = MIN_TIME;
+  while ((opt = getopt (argc, argv, "f:m:t:")) != -1)
+    switch (opt)
+      {
+      case 'f':
+	flags = optarg;
+	break;
+      case 'm':
+	max_size = strtol (optarg, NULL, 10) * 1024;
+	break;
+      case 't':
+	min_time = strtod (optarg, NULL);
+	break;
+      default:
+	usage (argv[0]);
+      }
+  if (optind != argc - 1)
+    usage (argv[0]);
+
+#ifndef __GLIBC__
+  xmlMemSetup (free, count_malloc, count_realloc, count_strdup);
+#endif
+  xmlInitParser ();
+
+  if ((module = dlopen (argv[optind], RTLD_NOW | RTLD_GLOBAL)) == NULL
+      || (*(void **) &init = dlsym (module, MODULE_INIT)) == NULL)
+    {
+      fprintf (stderr, "%s: %s\n", argv[0], dlerror ());
+      return 1;
+    }
+  (*init) ();
+
+  printf ("%-8s %-5s %6s %9s %10s %11s %10s\n", "function", "cache", "size",
+	  "items", "ns/item", "allocs/item", "peak RSS");
+  status = 0;
+  for (k = 0; k < sizeof sizes / sizeof sizes[0] && status == 0; k++)
+    {
+      if ((size = sizes[k]) > max_size)
+	break;
+      doc = make_doc (size, &nitems);
+      for (i = 0; i < sizeof ops / sizeof ops[0] && status == 0; i++)
+	{
+	  style[0] = make_style (ops[i].warm, flags);
+	  style[1] = make_style (ops[i].cold, flags);
+	  for (j = 0; j < 2 && status == 0; j++)
+	    if (style[j] == NULL
+		|| run_case (ops[i].name, j == 0 ? "warm" : "cold", style[j],
+			     doc, size, nitems, min_time) < 0)
+	      {
+		fprintf (stderr, "%s: %s failed\n", argv[0], ops[i].name);
+		status = 1;
+	      }
+	  for (j = 0; j < 2; j++)
+	    if (style[j] != NULL)
+	      xsltFreeStylesheet (style[j]);
+	}
+      xmlFreeDoc (doc);
+    }
+
+  xsltCleanupGlobals ();
+  xmlCleanupParser ();
+  return status;
+}
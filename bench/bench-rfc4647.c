@@ -0,0 +1,211 @@
+/* Benchmark for the RFC 4647 extended language range matcher.
+
+   usage: bench-rfc4647 [-n tags] [-t seconds]
+
+   Matches a list of language tags, some common and the rest generated from
+   typical subtags in mixed case, against a set of extended ranges, first
+   with rfc4647_extended_match() and then with each range compiled by
+   rfc4647_compile_range() and matched with rfc4647_range_match().  The
+   results are checked to be identical and the time per match of each is
+   reported. */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rfc4647.h"
+
+#define NTAGS		10000
+#define MIN_TIME	0.5	/* seconds each case is repeated for */
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/****************************************************************************
+ * Tags and ranges
+ ****************************************************************************/
+
+static const char *const common[] =
+  {
+    "en", "en-US", "en-GB", "fr", "fr-CA", "de", "de-DE", "de-CH-1996",
+    "zh-Hant-TW", "zh-Hans-CN", "sr-Latn-RS", "es-419", "pt-BR", "ja-JP",
+    "en-a-bbb-x-ccc", "x-private", "i-klingon", "sl-rozaj-biske",
+    "de-Latn-DE-1996", "hy-Latn-IT-arevela",
+  };
+
+static const char *const languages[] =
+  {
+    "en", "fr", "de", "es", "pt", "zh", "ja", "ko", "ru", "ar", "sr", "ga",
+    "nl", "it", "sv", "fi",
+  };
+
+static const char *const others[] =
+  {
+    "Latn", "Cyrl", "Hant", "Hans", "US", "GB", "DE", "CH", "IE", "419",
+    "1996", "rozaj", "a", "x", "bbb", "private",
+  };
+
+static const char *const ranges[] =
+  {
+    "en", "en-US", "*-US", "de-*-DE", "de-DE", "zh-Hant", "sr-*-RS", "*",
+    "es-419", "fr-*", "x-private", "en-GB-x-ccc", "ga-IE", "*-Latn-*",
+  };
+
+#define N(a)	(sizeof (a) / sizeof (a)[0])
+
+static unsigned long seed = 1;
+
+static unsigned long
+rnd (unsigned long n)
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 16) % n;
+}
+
+static void
+append (char *buf, size_t len, const char *subtag)
+{
+  size_t n = strlen (buf);
+
+  for (; *subtag != '\0' && n < len - 1; subtag++, n++)
+    buf[n] = rnd (3) == 0 && isalpha ((unsigned char) *subtag)
+	     ? (*subtag ^ 0x20) : *subtag;
+  buf[n] = '\0';
+}
+
+/* Return ntags tags, cycling through the common tags and generating the
+   rest from the subtag lists */
+static char **
+make_tags (int ntags)
+{
+  char **tags, buf[64];
+  int i, j, n;
+
+  if ((tags = malloc (ntags * sizeof (char *))) == NULL)
+    return NULL;
+  for (i = 0; i < ntags; i++)
+    {
+      if (i % 2 == 0)
+	strcpy (buf, common[(i / 2) % N (common)]);
+      else
+	{
+	  buf[0] = '\0';
+	  append (buf, sizeof buf, languages[rnd (N (languages))]);
+	  for (n = rnd (4), j = 0; j < n; j++)
+	    {
+	      append (buf, sizeof buf, "-");
+	      append (buf, sizeof buf, others[rnd (N (others))]);
+	    }
+	}
+      if ((tags[i] = strdup (buf)) == NULL)
+	return NULL;
+    }
+  return tags;
+}
+
+/****************************************************************************
+ * Driver
+ ****************************************************************************/
+
+static void
+usage (const char *prog)
+{
+  fprintf (stderr, "usage: %s [-n tags] [-t seconds]\n", prog);
+  exit (2);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct rfc4647_range *compiled[N (ranges)];
+  char **tags;
+  double min_time, start, elapsed[2];
+  unsigned long matches[2];
+  long runs[2];
+  size_t r;
+  int ntags, opt, i;
+
+  ntags = NTAGS;
+  min_time = MIN_TIME;
+  while ((opt = getopt (argc, argv, "n:t:")) != -1)
+    switch (opt)
+      {
+      case 'n':
+	ntags = strtol (optarg, NULL, 10);
+	break;
+      case 't':
+	min_time = strtod (optarg, NULL);
+	break;
+      default:
+	usage (argv[0]);
+      }
+  if (optind != argc || ntags <= 0)
+    usage (argv[0]);
+
+  if ((tags = make_tags (ntags)) == NULL)
+    {
+      fprintf (stderr, "%s: out of memory\n", argv[0]);
+      return 1;
+    }
+  for (r = 0; r < N (ranges); r++)
+    if ((compiled[r] = rfc4647_compile_range (ranges[r])) == NULL)
+      {
+	fprintf (stderr, "%s: cannot compile %s\n", argv[0], ranges[r]);
+	return 1;
+      }
+
+  for (r = 0; r < N (ranges); r++)
+    for (i = 0; i < ntags; i++)
+      if (rfc4647_extended_match (tags[i], ranges[r])
+	  != rfc4647_range_match (tags[i], compiled[r]))
+	{
+	  fprintf (stderr, "%s: %s and %s match differently\n",
+		   argv[0], tags[i], ranges[r]);
+	  return 1;
+	}
+
+  matches[0] = runs[0] = 0;
+  start = now ();
+  do
+    {
+      for (r = 0; r < N (ranges); r++)
+	for (i = 0; i < ntags; i++)
+	  matches[0] += rfc4647_extended_match (tags[i], ranges[r]);
+      runs[0]++;
+    }
+  while ((elapsed[0] = now () - start) < min_time);
+
+  matches[1] = runs[1] = 0;
+  start = now ();
+  do
+    {
+      for (r = 0; r < N (ranges); r++)
+	for (i = 0; i < ntags; i++)
+	  matches[1] += rfc4647_range_match (tags[i], compiled[r]);
+      runs[1]++;
+    }
+  while ((elapsed[1] = now () - start) < min_time);
+
+  printf ("%-10s %9s %10s %8s\n", "matcher", "calls", "ns/call", "matched");
+  for (i = 0; i < 2; i++)
+    printf ("%-10s %9ld %10.1f %8lu\n", i == 0 ? "string" : "compiled",
+	    runs[i] * ntags * (long) N (ranges),
+	    elapsed[i] * 1e9 / (runs[i] * ntags * N (ranges)),
+	    matches[i] / runs[i]);
+
+  for (r = 0; r < N (ranges); r++)
+    rfc4647_free_range (compiled[r]);
+  for (i = 0; i < ntags; i++)
+    free (tags[i]);
+  free (tags);
+  return 0;
+}
@@ -0,0 +1,398 @@
+#include <libxml/globals.h>
+#include <libxml/tree.h>
+#include <libxml/xpath.h>
+#include <libxml/xpathInternals.h>
+#include <libxml/hash.h>
+#include <libxml/threads.h>
+#include <libxslt/xsltconfig.h>
+#include <libxslt/xsltutils.h>
+#include <libxslt/xsltInternals.h>
+#include <libxslt/extensions.h>
+#include <libxslt/variables.h>
+#include "stats.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define _unused		__attribute__((unused))
+#define cX		(const xmlChar *)
+
+#define STATS_ENV	"XSLT_EXTRA_STATS"
+#define STATS_BUCKETS	40	/* latencies up to 2^40 ns, about 18 minutes */
+
+/* Not clear if xmlFree() is safe for NULL pointers */
+static inline void
+xmlSafeFree (void *ptr)
+{
+  if (ptr != NULL)
+    xmlFree (ptr);
+}
+
+/****************************************************************************
+ * Registry
+ *
+ * The wrapped functions are found by the name and namespace which libxml2
+ * records in the XPath context for the duration of each call.  Functions
+ * may be registered while other threads are transforming documents, for
+ * example by scripts, so the registry is locked.
+ ****************************************************************************/
+
+struct stats_function
+  {
+    xmlChar *name, *uri;
+    xmlXPathFunction function;
+  };
+
+static int enabled = -1;		/* -1 until the environment is read */
+static const char *stats_file;		/* file for the statistics or NULL */
+static xmlChar *module_uri;		/* the module's namespace */
+static xmlChar *stats_uri;		/* per transformation data */
+static xmlHashTable *registry;
+static xmlMutex *registry_lock;
+
+static int
+stats_enabled (void)
+{
+  const char *env;
+
+  if (enabled < 0)
+    {
+      env = getenv (STATS_ENV);
+      enabled = env != NULL;
+      stats_file = env != NULL && *env != '\0' ? env : NULL;
+    }
+  return enabled;
+}
+
+static struct stats_function *
+stats_lookup (const xmlChar *name, const xmlChar *uri)
+{
+  struct stats_function *func;
+
+  xmlMutexLock (registry_lock);
+  func = registry != NULL ? xmlHashLookup2 (registry, name, uri) : NULL;
+  xmlMutexUnlock (registry_lock);
+  return func;
+}
+
+/****************************************************************************
+ * Statistics for a transformation
+ ****************************************************************************/
+
+struct stats_entry
+  {
+    const struct stats_function *func;
+    unsigned long calls;
+    unsigned long long time;		/* total nanoseconds */
+    unsigned long hist[STATS_BUCKETS];	/* calls taking 2^n to 2^(n+1) ns */
+  };
+
+struct stats_data
+  {
+    xmlHashTable *table;
+    int nentries;
+  };
+
+static void *
+stats_ctxt_init (xsltTransformContext *tctxt _unused,
+		 const xmlChar *uri _unused)
+{
+  struct stats_data *data;
+
+  if ((data = xmlMalloc (sizeof (struct stats_data))) == NULL)
+    return NULL;
+  data->nentries = 0;
+  if ((data->table = xmlHashCreate (16)) == NULL)
+    {
+      xmlFree (data);
+      return NULL;
+    }
+  return data;
+}
+
+static struct stats_entry *
+stats_entry (struct stats_data *data, const xmlChar *name, const xmlChar *uri)
+{
+  struct stats_entry *entry;
+  const struct stats_function *func;
+
+  if ((entry = xmlHashLookup2 (data->table, name, uri)) != NULL)
+    return entry;
+  if ((func = stats_lookup (name, uri)) == NULL
+      || (entry = xmlMalloc (sizeof (struct stats_entry))) == NULL)
+    return NULL;
+  memset (entry, 0, sizeof (struct stats_entry));
+  entry->func = func;
+  if (xmlHashAddEntry2 (data->table, func->name, func->uri, entry) != 0)
+    {
+      xmlFree (entry);
+      return NULL;
+    }
+  data->nentries++;
+  return entry;
+}
+
+static void
+collect_entry (void *payload, void *data, const xmlChar *name _unused)
+{
+  struct stats_entry ***next = data;
+
+  *(*next)++ = payload;
+}
+
+static int
+entry_cmp (const void *a, const void *b)
+{
+  const struct stats_entry *x = *(const struct stats_entry *const *) a;
+  const struct stats_entry *y = *(const struct stats_entry *const *) b;
+
+  if (x->time != y->time)
+    return x->time < y->time ? 1 : -1;
+  return xmlStrcmp (x->func->name, y->func->name);
+}
+
+/* Add a function element for each function called to parent, the most
+   time consuming first */
+static int
+stats_elements (struct stats_data *data, xmlNode *parent)
+{
+  struct stats_entry **entries, **next, *entry;
+  xmlNode *function, *latency;
+  char buf[32];
+  int i, b;
+
+  if (data->nentries == 0)
+    return 0;
+  if ((entries = xmlMalloc (data->nentries * sizeof (struct stats_entry *)))
+      == NULL)
+    return -1;
+  next = entries;
+  xmlHashScan (data->table, collect_entry, &next);
+  qsort (entries, data->nentries, sizeof (struct stats_entry *), entry_cmp);
+
+  for (i = 0; i < data->nentries; i++)
+    {
+      entry = entries[i];
+      function = xmlNewChild (parent, NULL, cX "function", NULL);
+      if (function == NULL)
+	break;
+      xmlSetProp (function, cX "name", entry->func->name);
+      xmlSetProp (function, cX "namespace", entry->func->uri);
+      snprintf (buf, sizeof buf, "%lu", entry->calls);
+      xmlSetProp (function, cX "calls", cX buf);
+      snprintf (buf, sizeof buf, "%llu", entry->time);
+      xmlSetProp (function, cX "time", cX buf);
+      for (b = 0; b < STATS_BUCKETS; b++)
+	if (entry->hist[b] > 0)
+	  {
+	    latency = xmlNewChild (function, NULL, cX "latency", NULL);
+	    if (latency == NULL)
+	      break;
+	    snprintf (buf, sizeof buf, "%llu", 2ull << b);
+	    xmlSetProp (latency, cX "lt", cX buf);
+	    snprintf (buf, sizeof buf, "%lu", entry->hist[b]);
+	    xmlSetProp (latency, cX "calls", cX buf);
+	  }
+    }
+  xmlFree (entries);
+  return 0;
+}
+
+/* Append the statistics to the file as a single write so that output
+   from concurrent transformations is not interleaved */
+static void
+stats_dump (xsltTransformContext *tctxt, struct stats_data *data)
+{
+  xmlDoc *doc;
+  xmlNode *root;
+  xmlBuffer *buf;
+  int fd;
+
+  if ((doc = xmlNewDoc (cX "1.0")) == NULL)
+    return;
+  root = xmlNewDocNode (doc, NULL, cX "stats", NULL);
+  if (root == NULL || (buf = xmlBufferCreate ()) == NULL)
+    {
+      xmlFreeDoc (doc);
+      return;
+    }
+  xmlDocSetRootElement (doc, root);
+  xmlSetProp (root, cX "namespace", module_uri);
+  if (tctxt->style != NULL && tctxt->style->doc != NULL
+      && tctxt->style->doc->URL != NULL)
+    xmlSetProp (root, cX "stylesheet", tctxt->style->doc->URL);
+  if (stats_elements (data, root) == 0
+      && xmlNodeDump (buf, doc, root, 0, 0) >= 0
+      && xmlBufferCCat (buf, "\n") == 0)
+    {
+      fd = open (stats_file, O_WRONLY | O_APPEND | O_CREAT, 0666);
+      if (fd < 0
+	  || write (fd, xmlBufferContent (buf), xmlBufferLength (buf))
+	     != xmlBufferLength (buf))
+	xsltGenericError (xsltGenericErrorContext,
+			  "stats: cannot write %s\n", stats_file);
+      if (fd >= 0)
+	close (fd);
+    }
+  xmlBufferFree (buf);
+  xmlFreeDoc (doc);
+}
+
+static void
+free_entry (void *payload, const xmlChar *name _unused)
+{
+  xmlFree (payload);
+}
+
+static void
+stats_ctxt_shutdown (xsltTransformContext *tctxt, const xmlChar *uri _unused,
+		     void *ptr)
+{
+  struct stats_data *data = ptr;
+
+  if (data == NULL)
+    return;
+  if (stats_file != NULL && data->nentries > 0)
+    stats_dump (tctxt, data);
+  xmlHashFree (data->table, free_entry);
+  xmlFree (data);
+}
+
+/****************************************************************************
+ * Wrapper
+ ****************************************************************************/
+
+static inline unsigned long long
+elapsed (const struct timespec *start, const struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) * 1000000000ull
+	 + end->tv_nsec - start->tv_nsec;
+}
+
+static void
+stats_wrapper (xmlXPathParserContextPtr ctxt, int nargs)
+{
+  const xmlChar *name, *uri;
+  const struct stats_function *func;
+  xsltTransformContext *tctxt;
+  struct stats_data *data;
+  struct stats_entry *entry;
+  struct timespec start, end;
+  unsigned long long ns;
+  int b;
+
+  name = ctxt->context->function;
+  uri = ctxt->context->functionURI;
+  tctxt = xsltXPathGetTransformContext (ctxt);
+  if (tctxt == NULL || (data = xsltGetExtData (tctxt, stats_uri)) == NULL
+      || (entry = stats_entry (data, name, uri)) == NULL)
+    {
+      /* not transforming, call the function without recording it */
+      if ((func = stats_lookup (name, uri)) == NULL)
+	{
+	  xmlXPathErr (ctxt, XPATH_UNKNOWN_FUNC_ERROR);
+	  return;
+	}
+      (*func->function) (ctxt, nargs);
+      return;
+    }
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  (*entry->func->function) (ctxt, nargs);
+  clock_gettime (CLOCK_MONOTONIC, &end);
+
+  ns = elapsed (&start, &end);
+  b = 63 - __builtin_clzll (ns | 1);
+  entry->calls++;
+  entry->time += ns;
+  entry->hist[b < STATS_BUCKETS ? b : STATS_BUCKETS - 1]++;
+}
+
+int
+stats_register_function (const xmlChar *name, const xmlChar *uri,
+			 xmlXPathFunction function)
+{
+  struct stats_function *func;
+
+  if (!stats_enabled () || registry_lock == NULL)
+    return xsltRegisterExtModuleFunction (name, uri, function);
+
+  /* scripts register their functions again for each stylesheet */
+  if ((func = stats_lookup (name, uri)) != NULL && func->function == function)
+    return xsltRegisterExtModuleFunction (name, uri, stats_wrapper);
+
+  if ((func = xmlMalloc (sizeof (struct stats_function))) == NULL)
+    return -1;
+  func->name = xmlStrdup (name);
+  func->uri = xmlStrdup (uri);
+  func->function = function;
+  xmlMutexLock (registry_lock);
+  if (registry == NULL)
+    registry = xmlHashCreate (32);
+  /* a replaced function is not freed as transformations may refer to it */
+  if (func->name == NULL || func->uri == NULL || registry == NULL
+      || xmlHashUpdateEntry2 (registry, func->name, func->uri, func,
+			      NULL) != 0)
+    {
+      xmlMutexUnlock (registry_lock);
+      xmlSafeFree (func->name);
+      xmlSafeFree (func->uri);
+      xmlFree (func);
+      return -1;
+    }
+  xmlMutexUnlock (registry_lock);
+  return xsltRegisterExtModuleFunction (name, uri, stats_wrapper);
+}
+
+/****************************************************************************
+ * stats()
+ *
+ * Returns a node-set of function elements for the functions called so far
+ * in the current transformation.
+ ****************************************************************************/
+static void
+stats_function (xmlXPathParserContextPtr ctxt, int nargs)
+{
+  xsltTransformContext *tctxt;
+  struct stats_data *data;
+  xmlXPathObject *ret;
+  xmlDoc *container;
+  xmlNode *node;
+
+  if (nargs != 0)
+    {
+      xmlXPathSetArityError (ctxt);
+      return;
+    }
+
+  ret = xmlXPathNewNodeSet (NULL);
+  tctxt = xsltXPathGetTransformContext (ctxt);
+  if (ret != NULL && tctxt != NULL && stats_enabled ()
+      && (data = xsltGetExtData (tctxt, stats_uri)) != NULL
+      && (container = xsltCreateRVT (tctxt)) != NULL)
+    {
+      xsltRegisterTmpRVT (tctxt, container);
+      if (stats_elements (data, (xmlNode *) container) == 0)
+	for (node = container->children; node != NULL; node = node->next)
+	  xmlXPathNodeSetAddUnique (ret->nodesetval, node);
+    }
+  valuePush (ctxt, ret);
+}
+
+void
+stats_init (const xmlChar *uri)
+{
+  xsltRegisterExtModuleFunction (cX "stats", uri, stats_function);
+  if (!stats_enabled () || registry_lock != NULL)
+    return;
+  module_uri = xmlStrdup (uri);
+  stats_uri = xmlStrcat (xmlStrdup (uri), cX "#stats");
+  if (module_uri == NULL || stats_uri == NULL
+      || xsltRegisterExtModule (stats_uri, stats_ctxt_init,
+				stats_ctxt_shutdown) != 0)
+    return;
+  registry_lock = xmlNewMutex ();
+}
@@ -0,0 +1,22 @@
+#ifndef _stats_h
+#define _stats_h
+
+#include <libxml/xpath.h>
+
+/* Per-function call statistics for the extension modules.
+
+   When the XSLT_EXTRA_STATS environment variable is set, functions
+   registered with stats_register_function() are called through a wrapper
+   which records the number of calls, their total time and a histogram of
+   their latencies for each transformation.  If the variable names a file
+   the statistics are appended to it as each transformation ends.  When the
+   variable is not set functions are registered directly with libxslt.
+
+   stats_init() registers a stats() function in the module's namespace
+   which returns the statistics for the current transformation. */
+
+void stats_init (const xmlChar *uri);
+int stats_register_function (const xmlChar *name, const xmlChar *uri,
+			     xmlXPathFunction function);
+
+#endif
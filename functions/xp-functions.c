@@ -1,4 +1,8 @@
 #include <ctype.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <libxml/tree.h>
@@ -16,54 +20,371 @@
 #include <libxml/xpathInternals.h>
 
 #include "xp-functions.h"
+#include "stats.h"
+
+#define _unused	__attribute__((unused))
+
+/****************************************************************************
+ * Transformation data
+ *
+ * Caches which are only valid for the lifetime of a transformation, each
+ * allocated when first used.
+ ****************************************************************************/
+
+#define EXPR_CACHE	256		/* compiled expressions per transformation */
+
+struct class_entry;
+struct base_cache;
+struct uri_cache;
+
+struct fn_ctxt
+  {
+    xmlHashTable *exprs;		/* compiled XPath expressions */
+    struct class_entry *classes;	/* class-match() tokens */
+    struct base_cache *bases;		/* base-uri() of elements */
+    struct uri_cache *uris;		/* parsed base URIs */
+  };
+
+static void class_cache_free (struct class_entry *classes);
+static void base_cache_free (struct base_cache *cache);
+static void uri_cache_free (struct uri_cache *cache);
+
+static void *
+fn_ctxt_init (xsltTransformContext *tctxt _unused, const xmlChar *uri _unused)
+{
+  struct fn_ctxt *data;
+
+  if ((data = xmlMalloc (sizeof (struct fn_ctxt))) != NULL)
+    memset (data, 0, sizeof (struct fn_ctxt));
+  return data;
+}
+
+static void
+free_expr (void *payload, const xmlChar *name _unused)
+{
+  xmlXPathFreeCompExpr (payload);
+}
+
+static void
+fn_ctxt_shutdown (xsltTransformContext *tctxt _unused,
+		  const xmlChar *uri _unused, void *ptr)
+{
+  struct fn_ctxt *data = ptr;
+
+  if (data == NULL)
+    return;
+  if (data->exprs != NULL)
+    xmlHashFree (data->exprs, free_expr);
+  class_cache_free (data->classes);
+  base_cache_free (data->bases);
+  uri_cache_free (data->uris);
+  xmlFree (data);
+}
+
+static struct fn_ctxt *
+fn_get_ctxt (xmlXPathParserContextPtr ctxt)
+{
+  xsltTransformContext *tctxt;
+
+  if ((tctxt = xsltXPathGetTransformContext (ctxt)) == NULL)
+    return NULL;
+  return xsltGetExtData (tctxt, XSLT_FUNCTIONS_NAMESPACE);
+}
+
+/* Return the compiled expression, compiling it on first use.  *cached is
+   false if the caller must free the expression, as when the cache is
+   full. */
+static xmlXPathCompExpr *
+fn_compile (xmlXPathParserContextPtr ctxt, const xmlChar *expr, int *cached)
+{
+  struct fn_ctxt *data;
+  xmlXPathCompExpr *comp;
+
+  *cached = 0;
+  if ((data = fn_get_ctxt (ctxt)) == NULL)
+    return xmlXPathCompile (expr);
+  if (data->exprs == NULL && (data->exprs = xmlHashCreate (8)) == NULL)
+    return xmlXPathCompile (expr);
+  if ((comp = xmlHashLookup (data->exprs, expr)) != NULL)
+    {
+      *cached = 1;
+      return comp;
+    }
+  if ((comp = xmlXPathCompile (expr)) == NULL
+      || xmlHashSize (data->exprs) >= EXPR_CACHE)
+    return comp;
+  *cached = xmlHashAddEntry (data->exprs, expr, comp) == 0;
+  return comp;
+}
+
+/* Hash of a node's address for the caches */
+static inline unsigned
+node_hash (const void *node)
+{
+  return (unsigned) ((((uintptr_t) node >> 4) * 0x9e3779b1u) >> 8);
+}
 
 /****************************************************************************
- * string fn:string-join(node-set,string?)
+ * string fn:string-join(node-set,string?,string?)
  *	return the concatenation the string values of each node
- *      separated by the string specified in the 1st argument.
+ *      separated by the string specified in the 2nd argument.
+ *	If the 3rd argument is given it is an XPath expression evaluated
+ *	with each node as the context and its string value is used instead.
  ****************************************************************************/
 
+/* Copy the string value of node to buf, which may be NULL to measure it,
+   and return its length.  Text is copied directly from the tree so that
+   string-join() can size its result before copying. */
+
+static size_t
+copy_string (const xmlChar *str, xmlChar *buf)
+{
+  size_t len;
+
+  if (str == NULL)
+    return 0;
+  len = strlen ((const char *) str);
+  if (buf != NULL)
+    memcpy (buf, str, len);
+  return len;
+}
+
+static size_t
+copy_entity (xmlNode *node, xmlChar *buf)
+{
+  xmlChar *content;
+  size_t len;
+
+  content = xmlNodeGetContent (node);
+  len = copy_string (content, buf);
+  if (content != NULL)
+    xmlFree (content);
+  return len;
+}
+
+static size_t
+copy_content (xmlNode *node, xmlChar *buf)
+{
+  xmlNode *cur;
+  size_t len;
+
+  switch (node->type)
+    {
+    case XML_TEXT_NODE:
+    case XML_CDATA_SECTION_NODE:
+    case XML_COMMENT_NODE:
+    case XML_PI_NODE:
+      return copy_string (node->content, buf);
+    case XML_NAMESPACE_DECL:
+      return copy_string (((xmlNs *) node)->href, buf);
+    case XML_ELEMENT_NODE:
+    case XML_ATTRIBUTE_NODE:
+    case XML_DOCUMENT_NODE:
+    case XML_HTML_DOCUMENT_NODE:
+    case XML_DOCUMENT_FRAG_NODE:
+      break;
+    default:
+      return copy_entity (node, buf);
+    }
+
+  /* concatenate the descendant text nodes in document order */
+  len = 0;
+  cur = node->children;
+  while (cur != NULL)
+    {
+      if (cur->type == XML_TEXT_NODE || cur->type == XML_CDATA_SECTION_NODE)
+	len += copy_string (cur->content, buf != NULL ? buf + len : NULL);
+      else if (cur->type == XML_ENTITY_REF_NODE)
+	len += copy_entity (cur, buf != NULL ? buf + len : NULL);
+      else if (cur->type == XML_ELEMENT_NODE && cur->children != NULL)
+	{
+	  cur = cur->children;
+	  continue;
+	}
+      while (cur != NULL && cur->next == NULL)
+	cur = cur->parent != node ? cur->parent : NULL;
+      if (cur != NULL)
+	cur = cur->next;
+    }
+  return len;
+}
+
+/* Join the string values of the nodes, measuring them first so that the
+   result is allocated once */
+static xmlChar *
+join_nodes (xmlNodeSet *nodeset, const xmlChar *separator)
+{
+  xmlChar *result;
+  size_t len, seplen;
+  int i;
+
+  len = 0;
+  seplen = copy_string (separator, NULL);
+  if (nodeset != NULL && nodeset->nodeNr > 0)
+    {
+      for (i = 0; i < nodeset->nodeNr; i++)
+	len += copy_content (nodeset->nodeTab[i], NULL);
+      len += (nodeset->nodeNr - 1) * seplen;
+    }
+
+  if (len >= INT_MAX || (result = xmlMalloc (len + 1)) == NULL)
+    return NULL;
+
+  len = 0;
+  if (nodeset != NULL)
+    for (i = 0; i < nodeset->nodeNr; i++)
+      {
+	if (i > 0)
+	  {
+	    memcpy (result + len, separator, seplen);
+	    len += seplen;
+	  }
+	len += copy_content (nodeset->nodeTab[i], result + len);
+      }
+  result[len] = '\0';
+  return result;
+}
+
+/* Append the string value of obj to the buffer */
+static int
+append_value (xmlBuffer *buf, xmlXPathObject *obj)
+{
+  xmlChar *str;
+  int ret;
+
+  switch (obj->type)
+    {
+    case XPATH_STRING:
+      return xmlBufferCat (buf, obj->stringval);
+    case XPATH_NODESET:
+    case XPATH_XSLT_TREE:
+      if (obj->nodesetval == NULL || obj->nodesetval->nodeNr == 0)
+	return 0;
+      if (obj->nodesetval->nodeNr > 1)
+	xmlXPathNodeSetSort (obj->nodesetval);
+      return xmlNodeBufGetContent (buf, obj->nodesetval->nodeTab[0]);
+    default:
+      if ((str = xmlXPathCastToString (obj)) == NULL)
+	return -1;
+      ret = xmlBufferCat (buf, str);
+      xmlFree (str);
+      return ret;
+    }
+}
+
+/* Join the values of the expression evaluated for each node, appending
+   them directly to the result */
+static xmlChar *
+join_expr (xmlXPathParserContextPtr ctxt, xmlNodeSet *nodeset,
+	   const xmlChar *separator, xmlXPathCompExpr *comp)
+{
+  xmlXPathContext *xpctxt = ctxt->context;
+  xmlXPathObject *obj;
+  xmlBuffer *buf;
+  xmlDoc *doc;
+  xmlNode *node;
+  xmlChar *result;
+  int i, size, position, status;
+
+  if ((buf = xmlBufferCreate ()) == NULL)
+    {
+      xmlXPathErr (ctxt, XPATH_MEMORY_ERROR);
+      return NULL;
+    }
+  xmlBufferSetAllocationScheme (buf, XML_BUFFER_ALLOC_DOUBLEIT);
+
+  doc = xpctxt->doc;
+  node = xpctxt->node;
+  size = xpctxt->contextSize;
+  position = xpctxt->proximityPosition;
+
+  status = 0;
+  if (nodeset != NULL)
+    for (i = 0; i < nodeset->nodeNr && status == 0; i++)
+      {
+	/* / and id() refer to the node's document, as in xsl:for-each */
+	xpctxt->node = nodeset->nodeTab[i];
+	if (xpctxt->node->type != XML_NAMESPACE_DECL
+	    && xpctxt->node->doc != NULL)
+	  xpctxt->doc = xpctxt->node->doc;
+	xpctxt->contextSize = nodeset->nodeNr;
+	xpctxt->proximityPosition = i + 1;
+	if ((obj = xmlXPathCompiledEval (comp, xpctxt)) == NULL)
+	  {
+	    xmlXPathErr (ctxt, XPATH_EXPR_ERROR);
+	    status = -1;
+	    break;
+	  }
+	if ((i > 0 && xmlBufferCat (buf, separator) != 0)
+	    || append_value (buf, obj) != 0)
+	  {
+	    xmlXPathErr (ctxt, XPATH_MEMORY_ERROR);
+	    status = -1;
+	  }
+	xmlXPathFreeObject (obj);
+      }
+
+  xpctxt->doc = doc;
+  xpctxt->node = node;
+  xpctxt->contextSize = size;
+  xpctxt->proximityPosition = position;
+
+  result = status == 0 ? xmlBufferDetach (buf) : NULL;
+  xmlBufferFree (buf);
+  return result;
+}
+
 static void
 fn_string_join (xmlXPathParserContextPtr ctxt, int nargs)
 
 {
-  xmlChar *separator, *item, *result;
+  xmlChar *separator, *expr, *result;
+  xmlXPathCompExpr *comp;
   xmlNodeSet *nodeset;
-  int i;
+  int cached;
 
-  if (nargs == 1)
-    separator = xmlStrdup (cX"");
-  else if (nargs == 2)
-    separator = xmlXPathPopString (ctxt);
-  else
+  if (nargs < 1 || nargs > 3)
     {
       xmlGenericError (xmlGenericErrorContext,
-		       "fn:string-join(node-set,string?)\n");
+		       "fn:string-join(node-set,string?,string?)\n");
       ctxt->error = XPATH_INVALID_ARITY;
       return;
     }
+  expr = nargs == 3 ? xmlXPathPopString (ctxt) : NULL;
+  separator = nargs >= 2 ? xmlXPathPopString (ctxt) : xmlStrdup (cX"");
 
   nodeset = xmlXPathPopNodeSet (ctxt);
+  if (ctxt->error != XPATH_EXPRESSION_OK)
+    {
+      xmlXPathFreeNodeSet (nodeset);
+      xmlFree (separator);
+      xmlFree (expr);
+      return;
+    }
 
-  if (nodeset == NULL || nodeset->nodeNr < 1)
-    result = xmlStrdup (cX"");
+  if (expr == NULL)
+    {
+      if ((result = join_nodes (nodeset, separator)) == NULL)
+	xmlXPathErr (ctxt, XPATH_MEMORY_ERROR);
+    }
+  else if ((comp = fn_compile (ctxt, expr, &cached)) == NULL)
+    {
+      xmlXPathErr (ctxt, XPATH_EXPR_ERROR);
+      result = NULL;
+    }
   else
     {
-      result = xmlNodeGetContent (nodeset->nodeTab[0]);
-      for (i = 1; i < nodeset->nodeNr; i++)
-	{
-	  item = xmlNodeGetContent (nodeset->nodeTab[i]);
-	  result = xmlStrcat (result, separator);
-	  result = xmlStrcat (result, item);
-	  xmlFree (item);
-	}
+      result = join_expr (ctxt, nodeset, separator, comp);
+      if (!cached)
+	xmlXPathFreeCompExpr (comp);
     }
 
-  valuePush (ctxt, xmlXPathNewString (result));
+  if (result != NULL)
+    valuePush (ctxt, xmlXPathWrapString (result));
 
   xmlXPathFreeNodeSet (nodeset);
   xmlFree (separator);
-  xmlFree (result);
+  xmlFree (expr);
 }
 
 /****************************************************************************
@@ -100,6 +421,229 @@ fn_ends_with (xmlXPathParserContextPtr ctxt, int nargs)
   xmlFree (string);
 }
 
+/****************************************************************************
+ * Base URIs
+ *
+ * The base URI of each element is resolved against its parent's, as XML
+ * Base specifies, and cached for the transformation so that finding it is
+ * a hash probe rather than a walk to the root.  Only the source document
+ * and documents loaded by document() are cached since they are neither
+ * modified nor freed until the transformation ends.  Result tree fragments
+ * are recycled by libxslt and HTML documents find their base differently,
+ * so for these xmlNodeGetBase() is called as before.
+ ****************************************************************************/
+
+#define BASE_PATH	64		/* elements resolved per pass */
+
+struct base_entry
+  {
+    const xmlNode *node;
+    const xmlChar *base;		/* interned in dict */
+  };
+
+struct base_cache
+  {
+    struct base_entry *table;
+    unsigned size, count;		/* size is a power of 2 */
+    xmlDict *dict;
+  };
+
+static void
+base_cache_free (struct base_cache *cache)
+{
+  if (cache == NULL)
+    return;
+  if (cache->table != NULL)
+    xmlFree (cache->table);
+  if (cache->dict != NULL)
+    xmlDictFree (cache->dict);
+  xmlFree (cache);
+}
+
+static struct base_entry *
+base_probe (struct base_entry *table, unsigned size, const xmlNode *node)
+{
+  struct base_entry *entry;
+  unsigned h;
+
+  for (h = node_hash (node); ; h++)
+    {
+      entry = &table[h & (size - 1)];
+      if (entry->node == node || entry->node == NULL)
+	return entry;
+    }
+}
+
+static int
+base_insert (struct base_cache *cache, const xmlNode *node,
+	     const xmlChar *base)
+{
+  struct base_entry *table, *entry;
+  unsigned size, i;
+
+  if (2 * (cache->count + 1) > cache->size)
+    {
+      size = cache->size * 2;
+      if ((table = xmlMalloc (size * sizeof (struct base_entry))) == NULL)
+	return -1;
+      memset (table, 0, size * sizeof (struct base_entry));
+      for (i = 0; i < cache->size; i++)
+	if (cache->table[i].node != NULL)
+	  *base_probe (table, size, cache->table[i].node) = cache->table[i];
+      xmlFree (cache->table);
+      cache->table = table;
+      cache->size = size;
+    }
+  entry = base_probe (cache->table, cache->size, node);
+  entry->node = node;
+  entry->base = base;
+  cache->count++;
+  return 0;
+}
+
+/* Return the xml:base attribute of the element or NULL.  *alloc is set if
+   the value must be freed. */
+static const xmlChar *
+xml_base (const xmlNode *node, xmlChar **alloc)
+{
+  xmlAttr *attr;
+
+  *alloc = NULL;
+  if ((attr = xmlHasNsProp (node, cX"base", XML_XML_NAMESPACE)) == NULL)
+    return NULL;
+  if (attr->type == XML_ATTRIBUTE_DECL)
+    return ((xmlAttribute *) attr)->defaultValue;
+  if (attr->children != NULL && attr->children->next == NULL
+      && attr->children->type == XML_TEXT_NODE)
+    return attr->children->content;
+  return *alloc = xmlNodeGetContent ((xmlNode *) attr);
+}
+
+/* Find the base URI of the element, resolving and caching those of any
+   ancestors which have not been seen */
+static int
+base_lookup (struct base_cache *cache, const xmlNode *node,
+	     const xmlChar **pbase)
+{
+  const xmlNode *path[BASE_PATH], *cur;
+  const xmlChar *base, *value;
+  struct base_entry *entry;
+  xmlChar *alloc, *uri;
+  int n;
+
+  /* collect the elements up to the first which is cached */
+  entry = NULL;
+  n = 0;
+  for (cur = node; cur != NULL && cur->type == XML_ELEMENT_NODE;
+       cur = cur->parent)
+    {
+      entry = base_probe (cache->table, cache->size, cur);
+      if (entry->node == cur || n == BASE_PATH)
+	break;
+      path[n++] = cur;
+    }
+  if (cur == NULL || cur->type != XML_ELEMENT_NODE)
+    base = xmlDictLookup (cache->dict, node->doc->URL, -1);
+  else if (entry->node == cur)
+    base = entry->base;
+  else if (base_lookup (cache, cur, &base) != 0)
+    return -1;
+
+  /* and resolve each in turn against its parent */
+  while (n-- > 0)
+    {
+      if ((value = xml_base (path[n], &alloc)) != NULL)
+	{
+	  uri = base != NULL ? xmlBuildURI (value, base) : NULL;
+	  base = xmlDictLookup (cache->dict, uri != NULL ? uri : value, -1);
+	  if (uri != NULL)
+	    xmlFree (uri);
+	  if (alloc != NULL)
+	    xmlFree (alloc);
+	  if (base == NULL)
+	    return -1;
+	}
+      if (base_insert (cache, path[n], base) != 0)
+	return -1;
+    }
+  *pbase = base;
+  return 0;
+}
+
+/* True if the node is in a document which lasts for the transformation */
+static int
+base_cacheable (xsltTransformContext *tctxt, const xmlNode *node)
+{
+  xsltDocument *doc;
+
+  if (node->doc == NULL || node->doc->type != XML_DOCUMENT_NODE)
+    return 0;
+  if (tctxt->document != NULL && tctxt->document->doc == node->doc)
+    return 1;
+  for (doc = tctxt->docList; doc != NULL; doc = doc->next)
+    if (doc->doc == node->doc)
+      return 1;
+  return 0;
+}
+
+/* Return the base URI of node.  *alloc is set if it must be freed. */
+static const xmlChar *
+node_base (xmlXPathParserContextPtr ctxt, xmlNode *node, xmlChar **alloc)
+{
+  xsltTransformContext *tctxt;
+  struct fn_ctxt *data;
+  struct base_cache *cache;
+  const xmlNode *element;
+  const xmlChar *base;
+
+  *alloc = NULL;
+  tctxt = xsltXPathGetTransformContext (ctxt);
+  element = node;
+  switch (node->type)
+    {
+    case XML_ATTRIBUTE_NODE:
+    case XML_TEXT_NODE:
+    case XML_CDATA_SECTION_NODE:
+    case XML_COMMENT_NODE:
+    case XML_PI_NODE:
+      element = node->parent;
+      break;
+    case XML_ELEMENT_NODE:
+    case XML_DOCUMENT_NODE:
+      break;
+    default:
+      element = NULL;
+      break;
+    }
+
+  if (element != NULL && tctxt != NULL && base_cacheable (tctxt, node)
+      && (data = fn_get_ctxt (ctxt)) != NULL)
+    {
+      if ((cache = data->bases) == NULL
+	  && (cache = xmlMalloc (sizeof (struct base_cache))) != NULL)
+	{
+	  cache->size = 64;
+	  cache->count = 0;
+	  cache->table = xmlMalloc (cache->size * sizeof (struct base_entry));
+	  cache->dict = xmlDictCreate ();
+	  if (cache->table != NULL)
+	    memset (cache->table, 0, cache->size * sizeof (struct base_entry));
+	  if (cache->table == NULL || cache->dict == NULL)
+	    {
+	      base_cache_free (cache);
+	      cache = NULL;
+	    }
+	  data->bases = cache;
+	}
+      if (cache != NULL && base_lookup (cache, element, &base) == 0)
+	return base;
+    }
+
+  if ((*alloc = xmlNodeGetBase (node->doc, node)) == NULL)
+    return node->doc->URL;
+  return *alloc;
+}
+
 /****************************************************************************
  * string fn:base-uri(node-set?)
  * return the base URI of the 1st node in node-set or the context node
@@ -109,7 +653,8 @@ fn_ends_with (xmlXPathParserContextPtr ctxt, int nargs)
 static void
 fn_base_uri (xmlXPathParserContextPtr ctxt, int nargs)
 {
-  xmlChar *base;
+  const xmlChar *base;
+  xmlChar *alloc;
   xmlNodeSet *nodeset;
   xmlNode *node;
 
@@ -142,11 +687,306 @@ fn_base_uri (xmlXPathParserContextPtr ctxt, int nargs)
       return;
     }
 
-  if ((base = xmlNodeGetBase (node->doc, node)) == NULL)
-    base = xmlStrdup (node->doc->URL);
-
+  base = node_base (ctxt, node, &alloc);
   valuePush (ctxt, xmlXPathNewString (base));
-  xmlFree (base);
+  if (alloc != NULL)
+    xmlFree (alloc);
+}
+
+/****************************************************************************
+ * Parsed base URIs
+ *
+ * xmlBuildURI() parses the base URI again for every reference resolved,
+ * which resolve-uris() does for every node.  The most recently used base
+ * URIs are kept parsed for the transformation and references are resolved
+ * against them following the same steps as xmlBuildURI() in libxml2 2.9,
+ * including its private marker for an empty authority, so that the results
+ * are unchanged.  Later versions of libxml2 resolve references differently
+ * and with them xmlBuildURI() is called for every node.
+ ****************************************************************************/
+
+#if LIBXML_VERSION >= 20900 && LIBXML_VERSION < 21000
+# define URI_RESOLVE_CACHED	1
+#else
+# define URI_RESOLVE_CACHED	0
+#endif
+
+#define URI_CACHE		8
+#define PORT_EMPTY_SERVER	-1	/* xmlParseURI() marks "//" this way */
+
+struct uri_entry
+  {
+    xmlChar *base;
+    xmlURI *uri;			/* NULL if base is not a URI */
+  };
+
+struct uri_cache
+  {
+    struct uri_entry entries[URI_CACHE];	/* most recent first */
+    int n;
+  };
+
+static void
+uri_cache_free (struct uri_cache *cache)
+{
+  int i;
+
+  if (cache == NULL)
+    return;
+  for (i = 0; i < cache->n; i++)
+    {
+      xmlFree (cache->entries[i].base);
+      if (cache->entries[i].uri != NULL)
+	xmlFreeURI (cache->entries[i].uri);
+    }
+  xmlFree (cache);
+}
+
+#if URI_RESOLVE_CACHED
+static xmlURI *
+uri_parse (const xmlChar *base)
+{
+  xmlURI *uri;
+
+  if ((uri = xmlCreateURI ()) != NULL
+      && xmlParseURIReference (uri, (const char *) base) != 0)
+    {
+      xmlFreeURI (uri);
+      uri = NULL;
+    }
+  return uri;
+}
+
+/* Return the parsed base URI, which remains valid until the next call, or
+   NULL if it is not a URI.  Without a cache *alloc is set to the parsed
+   URI which the caller must free. */
+static xmlURI *
+uri_base (struct fn_ctxt *data, const xmlChar *base, xmlURI **alloc)
+{
+  struct uri_cache *cache;
+  struct uri_entry entry;
+  int i;
+
+  *alloc = NULL;
+  if (base == NULL)
+    return NULL;
+  if (data == NULL)
+    return *alloc = uri_parse (base);
+  if ((cache = data->uris) == NULL)
+    {
+      if ((cache = xmlMalloc (sizeof (struct uri_cache))) == NULL)
+	return *alloc = uri_parse (base);
+      cache->n = 0;
+      data->uris = cache;
+    }
+
+  for (i = 0; i < cache->n; i++)
+    if (xmlStrEqual (cache->entries[i].base, base))
+      {
+	entry = cache->entries[i];
+	memmove (&cache->entries[1], &cache->entries[0],
+		 i * sizeof (struct uri_entry));
+	cache->entries[0] = entry;
+	return entry.uri;
+      }
+
+  if ((entry.base = xmlStrdup (base)) == NULL)
+    return *alloc = uri_parse (base);
+  entry.uri = uri_parse (base);
+  if (cache->n == URI_CACHE)
+    {
+      cache->n--;
+      xmlFree (cache->entries[cache->n].base);
+      if (cache->entries[cache->n].uri != NULL)
+	xmlFreeURI (cache->entries[cache->n].uri);
+    }
+  memmove (&cache->entries[1], &cache->entries[0],
+	   cache->n * sizeof (struct uri_entry));
+  cache->entries[0] = entry;
+  cache->n++;
+  return entry.uri;
+}
+
+/* Resolve the reference against the parsed base URI, or NULL if there is
+   none, with the same result as xmlBuildURI() */
+static xmlChar *
+uri_resolve (const xmlChar *ref_str, xmlURI *bas)
+{
+  xmlURI *ref, *res;
+  xmlChar *val;
+  char *fragment;
+  int len, cur, out, i;
+
+  ref = res = NULL;
+  val = NULL;
+  if (ref_str == NULL)
+    return NULL;
+  if (*ref_str != '\0')
+    {
+      if ((ref = xmlCreateURI ()) == NULL)
+	return NULL;
+      if (xmlParseURIReference (ref, (const char *) ref_str) != 0)
+	goto done;
+      /* an absolute reference is returned unchanged */
+      if (ref->scheme != NULL)
+	{
+	  val = xmlStrdup (ref_str);
+	  goto done;
+	}
+    }
+  if (bas == NULL)
+    {
+      if (ref != NULL)
+	val = xmlSaveUri (ref);
+      goto done;
+    }
+  if (ref == NULL)
+    {
+      /* the base without its fragment */
+      fragment = bas->fragment;
+      bas->fragment = NULL;
+      val = xmlSaveUri (bas);
+      bas->fragment = fragment;
+      goto done;
+    }
+
+  if ((res = xmlCreateURI ()) == NULL)
+    goto done;
+  if (ref->scheme == NULL && ref->path == NULL
+      && ref->authority == NULL && ref->server == NULL)
+    {
+      if (bas->scheme != NULL)
+	res->scheme = xmlMemStrdup (bas->scheme);
+      if (bas->authority != NULL)
+	res->authority = xmlMemStrdup (bas->authority);
+      else if (bas->server != NULL || bas->port == PORT_EMPTY_SERVER)
+	{
+	  if (bas->server != NULL)
+	    res->server = xmlMemStrdup (bas->server);
+	  if (bas->user != NULL)
+	    res->user = xmlMemStrdup (bas->user);
+	  res->port = bas->port;
+	}
+      if (bas->path != NULL)
+	res->path = xmlMemStrdup (bas->path);
+      if (ref->query_raw != NULL)
+	res->query_raw = xmlMemStrdup (ref->query_raw);
+      else if (ref->query != NULL)
+	res->query = xmlMemStrdup (ref->query);
+      else if (bas->query_raw != NULL)
+	res->query_raw = xmlMemStrdup (bas->query_raw);
+      else if (bas->query != NULL)
+	res->query = xmlMemStrdup (bas->query);
+      if (ref->fragment != NULL)
+	res->fragment = xmlMemStrdup (ref->fragment);
+      goto save;
+    }
+
+  if (bas->scheme != NULL)
+    res->scheme = xmlMemStrdup (bas->scheme);
+  if (ref->query_raw != NULL)
+    res->query_raw = xmlMemStrdup (ref->query_raw);
+  else if (ref->query != NULL)
+    res->query = xmlMemStrdup (ref->query);
+  if (ref->fragment != NULL)
+    res->fragment = xmlMemStrdup (ref->fragment);
+
+  if (ref->authority != NULL || ref->server != NULL)
+    {
+      if (ref->authority != NULL)
+	res->authority = xmlMemStrdup (ref->authority);
+      else
+	{
+	  res->server = xmlMemStrdup (ref->server);
+	  if (ref->user != NULL)
+	    res->user = xmlMemStrdup (ref->user);
+	  res->port = ref->port;
+	}
+      if (ref->path != NULL)
+	res->path = xmlMemStrdup (ref->path);
+      goto save;
+    }
+  if (bas->authority != NULL)
+    res->authority = xmlMemStrdup (bas->authority);
+  else if (bas->server != NULL || bas->port == PORT_EMPTY_SERVER)
+    {
+      if (bas->server != NULL)
+	res->server = xmlMemStrdup (bas->server);
+      if (bas->user != NULL)
+	res->user = xmlMemStrdup (bas->user);
+      res->port = bas->port;
+    }
+
+  if (ref->path != NULL && ref->path[0] == '/')
+    {
+      res->path = xmlMemStrdup (ref->path);
+      goto save;
+    }
+
+  /* merge the reference with the directory of the base path */
+  len = 2;
+  if (ref->path != NULL)
+    len += strlen (ref->path);
+  if (bas->path != NULL)
+    len += strlen (bas->path);
+  if ((res->path = xmlMallocAtomic (len)) == NULL)
+    goto done;
+  out = 0;
+  if (bas->path != NULL)
+    for (cur = 0; bas->path[cur] != '\0'; )
+      {
+	while (bas->path[cur] != '\0' && bas->path[cur] != '/')
+	  cur++;
+	if (bas->path[cur] == '\0')
+	  break;
+	cur++;
+	while (out < cur)
+	  {
+	    res->path[out] = bas->path[out];
+	    out++;
+	  }
+      }
+  res->path[out] = '\0';
+  if (ref->path != NULL && ref->path[0] != '\0')
+    {
+      if (out == 0 && bas->server != NULL)
+	res->path[out++] = '/';
+      for (i = 0; ref->path[i] != '\0'; i++)
+	res->path[out++] = ref->path[i];
+    }
+  res->path[out] = '\0';
+  xmlNormalizeURIPath (res->path);
+
+save:
+  val = xmlSaveUri (res);
+done:
+  if (ref != NULL)
+    xmlFreeURI (ref);
+  if (res != NULL)
+    xmlFreeURI (res);
+  return val;
+}
+
+#endif
+
+/* Resolve the reference against the base URI as xmlBuildURI() does, using
+   the parsed base URIs where possible */
+static xmlChar *
+uri_build (struct fn_ctxt *data _unused, const xmlChar *ref,
+	   const xmlChar *base)
+{
+#if URI_RESOLVE_CACHED
+  xmlURI *parsed, *alloc;
+  xmlChar *uri;
+
+  parsed = uri_base (data, base, &alloc);
+  uri = uri_resolve (ref, parsed);
+  if (alloc != NULL)
+    xmlFreeURI (alloc);
+  return uri;
+#else
+  return xmlBuildURI (ref, base);
+#endif
 }
 
 /****************************************************************************
@@ -158,17 +998,13 @@ fn_base_uri (xmlXPathParserContextPtr ctxt, int nargs)
 static void
 fn_resolve_uri (xmlXPathParserContextPtr ctxt, int nargs)
 {
-  xmlChar *relative, *base, *uri;
-  xmlNode *node;
+  xmlChar *relative, *alloc, *uri;
+  const xmlChar *base;
 
   if (nargs == 1)
-    {
-      node = ctxt->context->node;
-      if ((base = xmlNodeGetBase (node->doc, node)) == NULL)
-        base = xmlStrdup (node->doc->URL);
-    }
+    base = node_base (ctxt, ctxt->context->node, &alloc);
   else if (nargs == 2)
-    base = xmlXPathPopString (ctxt);
+    base = alloc = xmlXPathPopString (ctxt);
   else
     {
       xmlGenericError (xmlGenericErrorContext,
@@ -181,32 +1017,775 @@ fn_resolve_uri (xmlXPathParserContextPtr ctxt, int nargs)
   uri = xmlBuildURI (relative, base);
   valuePush (ctxt, xmlXPathNewString (uri));
 
-  xmlFree (base);
+  xmlFree (alloc);
   xmlFree (relative);
   xmlFree (uri);
 }
 
-/****************************************************************************/
+/****************************************************************************
+ * node-set fn:resolve-uris(node-set, string?)
+ * return a uri element for each node in the node-set containing its string
+ * value resolved against the base URI in the 2nd argument, or the node's
+ * own base URI if the argument is omitted.
+ ****************************************************************************/
+
+static void
+fn_resolve_uris (xmlXPathParserContextPtr ctxt, int nargs)
+{
+  xsltTransformContext *tctxt;
+  struct fn_ctxt *data;
+  xmlNodeSet *nodeset;
+  xmlXPathObject *ret;
+  xmlDoc *container;
+  xmlNode *node, *elem;
+  xmlChar *base, *alloc, *relative, *uri;
+  const xmlChar *node_uri;
+  int i;
+
+  if (nargs < 1 || nargs > 2)
+    {
+      xmlGenericError (xmlGenericErrorContext,
+		       "fn:resolve-uris($nodes as node-set,$base as string?)\n");
+      ctxt->error = XPATH_INVALID_ARITY;
+      return;
+    }
+
+  base = (nargs == 2) ? xmlXPathPopString (ctxt) : NULL;
+  nodeset = xmlXPathPopNodeSet (ctxt);
+  tctxt = xsltXPathGetTransformContext (ctxt);
+  if (ctxt->error != XPATH_EXPRESSION_OK || tctxt == NULL)
+    {
+      if (ctxt->error == XPATH_EXPRESSION_OK)
+	xmlXPathErr (ctxt, XPATH_INVALID_CTXT);
+      xmlXPathFreeNodeSet (nodeset);
+      xmlFree (base);
+      return;
+    }
+
+  data = fn_get_ctxt (ctxt);
+  ret = xmlXPathNewNodeSet (NULL);
+  container = NULL;
+  if (ret != NULL && nodeset != NULL && nodeset->nodeNr > 0
+      && (container = xsltCreateRVT (tctxt)) != NULL)
+    xsltRegisterTmpRVT (tctxt, container);
+
+  for (i = 0; container != NULL && nodeset != NULL && i < nodeset->nodeNr; i++)
+    {
+      node = nodeset->nodeTab[i];
+      alloc = NULL;
+      node_uri = base != NULL ? base : node_base (ctxt, node, &alloc);
+      relative = xmlXPathCastNodeToString (node);
+      uri = uri_build (data, relative, node_uri);
 
+      elem = xmlNewDocRawNode (container, NULL, cX"uri", NULL);
+      if (elem != NULL)
+	{
+	  xmlAddChild ((xmlNode *) container, elem);
+	  if (uri != NULL && *uri != '\0')
+	    xmlAddChild (elem, xmlNewDocText (container, uri));
+	  xmlXPathNodeSetAddUnique (ret->nodesetval, elem);
+	}
+
+      xmlFree (alloc);
+      xmlFree (relative);
+      xmlFree (uri);
+    }
+
+  valuePush (ctxt, ret);
+  xmlXPathFreeNodeSet (nodeset);
+  xmlFree (base);
+}
+
+/****************************************************************************
+ * URI components
+ *
+ * uri_split() finds the components of a URI reference in a single pass
+ * following the grammar of RFC 3986 appendix B, recording each as a slice
+ * of the original string so that nothing is copied until a result is
+ * returned.
+ ****************************************************************************/
+
+struct uri_part
+  {
+    const xmlChar *str;
+    int len;				/* -1 if the component is absent */
+  };
+
+struct uri_parts
+  {
+    struct uri_part scheme, userinfo, host, port, path, query, fragment;
+  };
+
+#define IS_ALPHA(c)	(((c) | 0x20) >= 'a' && ((c) | 0x20) <= 'z')
+#define IS_DIGIT(c)	((c) >= '0' && (c) <= '9')
+#define IS_HEX(c)	(IS_DIGIT (c) || (((c) | 0x20) >= 'a' && ((c) | 0x20) <= 'f'))
+#define HEX_VALUE(c)	(IS_DIGIT (c) ? (c) - '0' : ((c) | 0x20) - 'a' + 10)
+#define TO_LOWER(c)	((c) >= 'A' && (c) <= 'Z' ? (c) | 0x20 : (c))
+
+static void
+uri_part_set (struct uri_part *part, const xmlChar *start, const xmlChar *end)
+{
+  part->str = start;
+  part->len = end - start;
+}
+
+static void
+uri_split (const xmlChar *uri, struct uri_parts *parts)
+{
+  const xmlChar *p, *q, *end, *at, *host;
+
+  memset (parts, 0, sizeof *parts);
+  parts->scheme.len = parts->userinfo.len = parts->host.len = -1;
+  parts->port.len = parts->query.len = parts->fragment.len = -1;
+
+  p = uri;
+  if (IS_ALPHA (*p))
+    {
+      for (q = p + 1; IS_ALPHA (*q) || IS_DIGIT (*q)
+		      || *q == '+' || *q == '-' || *q == '.'; q++)
+	;
+      if (*q == ':')
+	{
+	  uri_part_set (&parts->scheme, p, q);
+	  p = q + 1;
+	}
+    }
+
+  if (p[0] == '/' && p[1] == '/')
+    {
+      p += 2;
+      end = p + strcspn ((const char *) p, "/?#");
+      at = NULL;
+      for (q = p; q < end; q++)
+	if (*q == '@')
+	  at = q;
+      host = p;
+      if (at != NULL)
+	{
+	  uri_part_set (&parts->userinfo, p, at);
+	  host = at + 1;
+	}
+      q = host;
+      if (*q == '[')
+	while (q < end && *q != ']')
+	  q++;
+      while (q < end && *q != ':')
+	q++;
+      uri_part_set (&parts->host, host, q);
+      if (q < end)
+	uri_part_set (&parts->port, q + 1, end);
+      p = end;
+    }
+
+  q = p + strcspn ((const char *) p, "?#");
+  uri_part_set (&parts->path, p, q);
+  p = q;
+  if (*p == '?')
+    {
+      q = p + 1 + strcspn ((const char *) p + 1, "#");
+      uri_part_set (&parts->query, p + 1, q);
+      p = q;
+    }
+  if (*p == '#')
+    uri_part_set (&parts->fragment, p + 1, p + 1 + strlen ((const char *) p + 1));
+}
+
+static xmlXPathObject *
+uri_part_string (const struct uri_part *part)
+{
+  if (part->len <= 0)
+    return xmlXPathNewCString ("");
+  return xmlXPathWrapString (xmlStrndup (part->str, part->len));
+}
+
+/* Decode an application/x-www-form-urlencoded name or value to out, which
+   has room for len bytes, and return its length */
+static int
+form_decode (xmlChar *out, const xmlChar *str, int len)
+{
+  int i, n;
+
+  for (i = n = 0; i < len; i++)
+    if (str[i] == '+')
+      out[n++] = ' ';
+    else if (str[i] == '%' && i + 2 < len
+	     && IS_HEX (str[i + 1]) && IS_HEX (str[i + 2]))
+      {
+	out[n++] = HEX_VALUE (str[i + 1]) << 4 | HEX_VALUE (str[i + 2]);
+	i += 2;
+      }
+    else
+      out[n++] = str[i];
+  return n;
+}
+
+/* Copy the component to out with percent-encoded unreserved characters
+   decoded and the hexadecimal digits of other percent-encodings in upper
+   case, in lower case if lower is set, and return its length */
+static int
+uri_part_normalize (xmlChar *out, const struct uri_part *part, int lower)
+{
+  const xmlChar *str;
+  int i, n, c;
+
+  str = part->str;
+  for (i = n = 0; i < part->len; i++)
+    if (str[i] == '%' && i + 2 < part->len
+	&& IS_HEX (str[i + 1]) && IS_HEX (str[i + 2]))
+      {
+	c = HEX_VALUE (str[i + 1]) << 4 | HEX_VALUE (str[i + 2]);
+	if (IS_ALPHA (c) || IS_DIGIT (c)
+	    || c == '-' || c == '.' || c == '_' || c == '~')
+	  out[n++] = lower ? TO_LOWER (c) : c;
+	else
+	  {
+	    out[n++] = '%';
+	    out[n++] = "0123456789ABCDEF"[c >> 4];
+	    out[n++] = "0123456789ABCDEF"[c & 15];
+	  }
+	i += 2;
+      }
+    else
+      out[n++] = lower ? TO_LOWER (str[i]) : str[i];
+  return n;
+}
+
+/* Remove the "." and ".." segments of the path in place as described in
+   RFC 3986 section 5.2.4 and return its new length */
+static int
+uri_remove_dots (xmlChar *path, int len)
+{
+  int i, n;
+
+  i = n = 0;
+  while (i < len)
+    if (len - i >= 3 && memcmp (path + i, "../", 3) == 0)
+      i += 3;
+    else if (len - i >= 2 && memcmp (path + i, "./", 2) == 0)
+      i += 2;
+    else if (len - i >= 3 && memcmp (path + i, "/./", 3) == 0)
+      i += 2;
+    else if (len - i == 2 && memcmp (path + i, "/.", 2) == 0)
+      {
+	path[n++] = '/';
+	i = len;
+      }
+    else if (len - i >= 3 && memcmp (path + i, "/..", 3) == 0
+	     && (len - i == 3 || path[i + 3] == '/'))
+      {
+	while (n > 0 && path[--n] != '/')
+	  ;
+	if ((i += 3) == len)
+	  path[n++] = '/';
+      }
+    else if ((len - i == 1 && path[i] == '.')
+	     || (len - i == 2 && memcmp (path + i, "..", 2) == 0))
+      i = len;
+    else
+      do
+	path[n++] = path[i++];
+      while (i < len && path[i] != '/');
+  return n;
+}
+
+static const struct
+  {
+    const char *scheme, *port;
+  }
+default_ports[] =
+  {
+    { "http", "80" }, { "https", "443" }, { "ws", "80" }, { "wss", "443" },
+    { "ftp", "21" },
+  };
+
+/* Return the index of the scheme in default_ports or -1 */
+static int
+uri_known_scheme (const xmlChar *scheme, int len)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof default_ports / sizeof default_ports[0]; i++)
+    if (strlen (default_ports[i].scheme) == (size_t) len
+	&& memcmp (scheme, default_ports[i].scheme, len) == 0)
+      return i;
+  return -1;
+}
+
+/* Return the URI with the syntax-based normalisation of RFC 3986 section
+   6.2.2 and the default port and empty path of well known schemes
+   normalised */
+static xmlChar *
+uri_normalize (const xmlChar *uri)
+{
+  struct uri_parts parts;
+  xmlChar *out;
+  int n, path, known;
+
+  /* normalisation never lengthens a URI except for an empty path */
+  if ((out = xmlMallocAtomic (strlen ((const char *) uri) + 2)) == NULL)
+    return NULL;
+  uri_split (uri, &parts);
+  n = 0;
+  known = -1;
+  if (parts.scheme.len >= 0)
+    {
+      n = uri_part_normalize (out, &parts.scheme, 1);
+      known = uri_known_scheme (out, n);
+      out[n++] = ':';
+    }
+  if (parts.host.len >= 0)
+    {
+      out[n++] = '/';
+      out[n++] = '/';
+      if (parts.userinfo.len >= 0)
+	{
+	  n += uri_part_normalize (out + n, &parts.userinfo, 0);
+	  out[n++] = '@';
+	}
+      n += uri_part_normalize (out + n, &parts.host, 1);
+      if (parts.port.len > 0
+	  && (known < 0
+	      || strlen (default_ports[known].port) != (size_t) parts.port.len
+	      || memcmp (parts.port.str, default_ports[known].port,
+			 parts.port.len) != 0))
+	{
+	  out[n++] = ':';
+	  memcpy (out + n, parts.port.str, parts.port.len);
+	  n += parts.port.len;
+	}
+    }
+
+  path = n;
+  n += uri_part_normalize (out + n, &parts.path, 0);
+  /* dot segments of a relative path are left for resolution */
+  if (parts.scheme.len >= 0 || parts.host.len >= 0)
+    n = path + uri_remove_dots (out + path, n - path);
+  if (n == path && parts.host.len >= 0 && known >= 0)
+    out[n++] = '/';
+
+  if (parts.query.len >= 0)
+    {
+      out[n++] = '?';
+      n += uri_part_normalize (out + n, &parts.query, 0);
+    }
+  if (parts.fragment.len >= 0)
+    {
+      out[n++] = '#';
+      n += uri_part_normalize (out + n, &parts.fragment, 0);
+    }
+  out[n] = '\0';
+  return out;
+}
+
+/****************************************************************************
+ * string fn:uri-scheme(string)
+ * string fn:uri-host(string)
+ * string fn:uri-path(string)
+ * return the scheme, host or path of the URI as it is written, or an
+ * empty string if it has none.
+ ****************************************************************************/
+
+static void
+uri_part_function (xmlXPathParserContextPtr ctxt, int nargs,
+		   const char *usage, size_t offset)
+{
+  struct uri_parts parts;
+  xmlChar *uri;
+
+  if (nargs != 1)
+    {
+      xmlGenericError (xmlGenericErrorContext, "%s\n", usage);
+      ctxt->error = XPATH_INVALID_ARITY;
+      return;
+    }
+
+  uri = xmlXPathPopString (ctxt);
+  if (uri == NULL)
+    return;
+  uri_split (uri, &parts);
+  valuePush (ctxt, uri_part_string ((struct uri_part *)
+				    ((char *) &parts + offset)));
+  xmlFree (uri);
+}
+
+static void
+fn_uri_scheme (xmlXPathParserContextPtr ctxt, int nargs)
+{
+  uri_part_function (ctxt, nargs, "fn:uri-scheme($uri as string)",
+		     offsetof (struct uri_parts, scheme));
+}
+
+static void
+fn_uri_host (xmlXPathParserContextPtr ctxt, int nargs)
+{
+  uri_part_function (ctxt, nargs, "fn:uri-host($uri as string)",
+		     offsetof (struct uri_parts, host));
+}
+
+static void
+fn_uri_path (xmlXPathParserContextPtr ctxt, int nargs)
+{
+  uri_part_function (ctxt, nargs, "fn:uri-path($uri as string)",
+		     offsetof (struct uri_parts, path));
+}
+
+/****************************************************************************
+ * string fn:uri-query-param(string, string)
+ * return the decoded value of the first parameter of the URI's query
+ * which has the name in the 2nd argument, or an empty string if there is
+ * none.
+ ****************************************************************************/
+
+static void
+fn_uri_query_param (xmlXPathParserContextPtr ctxt, int nargs)
+{
+  struct uri_parts parts;
+  const xmlChar *p, *end, *field, *eq;
+  xmlChar *uri, *name, *buf, *value;
+  size_t name_len;
+  int n;
+
+  if (nargs != 2)
+    {
+      xmlGenericError (xmlGenericErrorContext,
+		       "fn:uri-query-param($uri as string,$name as string)\n");
+      ctxt->error = XPATH_INVALID_ARITY;
+      return;
+    }
+
+  name = xmlXPathPopString (ctxt);
+  uri = xmlXPathPopString (ctxt);
+  value = NULL;
+  if (uri != NULL && name != NULL)
+    {
+      uri_split (uri, &parts);
+      buf = NULL;
+      if (parts.query.len > 0)
+	buf = xmlMallocAtomic (parts.query.len + 1);
+      name_len = strlen ((const char *) name);
+      p = parts.query.str;
+      end = p + parts.query.len;
+      for (; buf != NULL && p < end; p = field + 1)
+	{
+	  if ((field = memchr (p, '&', end - p)) == NULL)
+	    field = end;
+	  if ((eq = memchr (p, '=', field - p)) == NULL)
+	    eq = field;
+	  n = form_decode (buf, p, eq - p);
+	  if ((size_t) n == name_len && memcmp (buf, name, n) == 0)
+	    {
+	      n = (eq < field) ? form_decode (buf, eq + 1, field - eq - 1) : 0;
+	      buf[n] = '\0';
+	      value = buf;
+	      buf = NULL;
+	    }
+	}
+      xmlFree (buf);
+    }
+  valuePush (ctxt, value != NULL ? xmlXPathWrapString (value)
+				 : xmlXPathNewCString (""));
+  xmlFree (name);
+  xmlFree (uri);
+}
+
+/****************************************************************************
+ * string fn:uri-normalize(string)
+ * return the URI normalised as RFC 3986 section 6 describes.
+ ****************************************************************************/
+
+static void
+fn_uri_normalize (xmlXPathParserContextPtr ctxt, int nargs)
+{
+  xmlChar *uri;
+
+  if (nargs != 1)
+    {
+      xmlGenericError (xmlGenericErrorContext,
+		       "fn:uri-normalize($uri as string)\n");
+      ctxt->error = XPATH_INVALID_ARITY;
+      return;
+    }
+
+  uri = xmlXPathPopString (ctxt);
+  if (uri == NULL)
+    return;
+  valuePush (ctxt, xmlXPathWrapString (uri_normalize (uri)));
+  xmlFree (uri);
+}
+
+/****************************************************************************
+ * Class tokens
+ *
+ * Class lists are split at ASCII white space, as in HTML, independently of
+ * the locale.  The tokens of attributes are cached for the transformation
+ * in a small direct mapped table indexed by the attribute node so that
+ * repeated tests on the same element are a hash lookup.  The attribute's
+ * value is kept with its tokens and compared on each lookup so that a node
+ * which has changed, or was freed and reused, is split again.
+ ****************************************************************************/
+
+#define CLASS_CACHE	256		/* entries, a power of 2 */
+
+struct class_token
+  {
+    int off, len;
+  };
+
+struct class_entry
+  {
+    const xmlNode *node;
+    xmlChar *value;
+    int len;
+    struct class_token *tokens;
+    int *slots;				/* hash of token index + 1, or 0 */
+    unsigned mask;			/* number of slots - 1 */
+  };
+
+static inline int
+is_class_space (int c)
+{
+  return c == ' ' || (unsigned) (c - '\t') <= '\r' - '\t';
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/* Bit mask of the white space in the 16 bytes at s */
+static inline unsigned
+space_mask (const xmlChar *s)
+{
+  __m128i c, v;
+
+  c = _mm_loadu_si128 ((const __m128i *) s);
+  v = _mm_sub_epi8 (c, _mm_set1_epi8 ('\t'));
+  v = _mm_cmpeq_epi8 (_mm_min_epu8 (v, _mm_set1_epi8 ('\r' - '\t')), v);
+  v = _mm_or_si128 (v, _mm_cmpeq_epi8 (c, _mm_set1_epi8 (' ')));
+  return _mm_movemask_epi8 (v);
+}
+#endif
+
+/* Split the class list into tokens, which must have room for len / 2 + 1
+   entries, and return the number found.  With SSE2 the list is examined
+   16 bytes at a time and the tokens are found from the edges of the white
+   space mask. */
+static int
+class_split (const xmlChar *s, int len, struct class_token *tokens)
+{
+  int i, n, start;
+#ifdef __SSE2__
+  unsigned mask, edges, prev;
+#endif
+
+  n = 0;
+  start = -1;
+  i = 0;
+#ifdef __SSE2__
+  for (prev = 1; i + 16 <= len; i += 16)
+    {
+      mask = space_mask (s + i);
+      edges = (mask ^ ((mask << 1) | prev)) & 0xffff;
+      prev = mask >> 15;
+      for (; edges != 0; edges &= edges - 1)
+	if (start < 0)
+	  start = i + __builtin_ctz (edges);
+	else
+	  {
+	    tokens[n].off = start;
+	    tokens[n].len = i + __builtin_ctz (edges) - start;
+	    n++;
+	    start = -1;
+	  }
+    }
+#endif
+  for (; i < len; i++)
+    if (!is_class_space (s[i]))
+      {
+	if (start < 0)
+	  start = i;
+      }
+    else if (start >= 0)
+      {
+	tokens[n].off = start;
+	tokens[n].len = i - start;
+	n++;
+	start = -1;
+      }
+  if (start >= 0)
+    {
+      tokens[n].off = start;
+      tokens[n].len = len - start;
+      n++;
+    }
+  return n;
+}
+
+/* Hash a token from its length and up to 8 bytes at each end, which is
+   enough to tell typical class names apart without reading all of them */
+static unsigned
+token_hash (const xmlChar *s, int len)
+{
+  uint64_t head = 0, tail = 0;
+  int n = len < 8 ? len : 8;
+
+  memcpy (&head, s, n);
+  memcpy (&tail, s + len - n, n);
+  head = (head * 0x9e3779b97f4a7c15u ^ tail) * 0xff51afd7ed558ccdu;
+  return (unsigned) (head >> 32) ^ len;
+}
+
+/* Test for name among the tokens of an uncached class list.  A name
+   containing a space is not a token and never matches, as with a cached
+   list. */
 static int
-class_match (const char *class, const char *name)
+class_match (const xmlChar *class, const xmlChar *name, int nlen)
 {
   const char *p;
-  int len;
+  int i;
+
+  if (nlen == 0)
+    return 0;
+  for (i = 0; i < nlen; i++)
+    if (is_class_space (name[i]))
+      return 0;
+  for (p = strstr ((const char *) class, (const char *) name); p != NULL;
+       p = strstr (p + nlen, (const char *) name))
+    if ((p == (const char *) class || is_class_space (p[-1]))
+	&& (p[nlen] == '\0' || is_class_space (p[nlen])))
+      return 1;
+  return 0;
+}
+
+static void
+class_entry_clear (struct class_entry *entry)
+{
+  if (entry->value != NULL)
+    xmlFree (entry->value);
+  if (entry->tokens != NULL)
+    xmlFree (entry->tokens);
+  memset (entry, 0, sizeof (struct class_entry));
+}
+
+/* Split the value into the cache entry for node and hash its tokens */
+static struct class_entry *
+class_entry_fill (struct class_entry *entry, const xmlNode *node,
+		  const xmlChar *value, int len)
+{
+  struct class_token *tokens;
+  unsigned size, h;
+  int i, n;
 
-  if (class != NULL && name != NULL && *name != '\0'
-      && (p = strstr (class, name)) != NULL)
+  class_entry_clear (entry);
+  if ((entry->value = xmlStrndup (value, len)) == NULL
+      || (tokens = xmlMalloc ((len / 2 + 1) * sizeof (struct class_token)))
+	 == NULL)
     {
-      len = strlen (name);
-      do
-	if ((p == class || isspace (p[-1]))
-	    && (p[len] == '\0' || isspace (p[len])))
-	  return 1;
-      while ((p = strstr (p + len, name)) != NULL);
+      class_entry_clear (entry);
+      return NULL;
+    }
+  n = class_split (value, len, tokens);
+
+  /* keep the table at most half full */
+  for (size = 4; size < 2u * n; size <<= 1)
+    ;
+  entry->tokens = xmlRealloc (tokens, n * sizeof (struct class_token)
+				      + size * sizeof (int));
+  if (entry->tokens == NULL)
+    {
+      xmlFree (tokens);
+      class_entry_clear (entry);
+      return NULL;
+    }
+  entry->slots = (int *) (entry->tokens + n);
+  entry->mask = size - 1;
+  memset (entry->slots, 0, size * sizeof (int));
+  for (i = 0; i < n; i++)
+    {
+      h = token_hash (value + entry->tokens[i].off, entry->tokens[i].len);
+      while (entry->slots[h & entry->mask] != 0)
+	h++;
+      entry->slots[h & entry->mask] = i + 1;
+    }
+  entry->node = node;
+  entry->len = len;
+  return entry;
+}
+
+static int
+class_entry_match (const struct class_entry *entry, const xmlChar *name,
+		   int nlen)
+{
+  const struct class_token *token;
+  unsigned h;
+  int i;
+
+  if (nlen == 0)
+    return 0;
+  for (h = token_hash (name, nlen); (i = entry->slots[h & entry->mask]) != 0;
+       h++)
+    {
+      token = &entry->tokens[i - 1];
+      if (token->len == nlen
+	  && memcmp (entry->value + token->off, name, nlen) == 0)
+	return 1;
     }
   return 0;
 }
 
+static struct class_entry *
+class_lookup (struct fn_ctxt *data, const xmlNode *node, const xmlChar *value,
+	      int len)
+{
+  struct class_entry *entry;
+
+  if (data->classes == NULL)
+    {
+      data->classes = xmlMalloc (CLASS_CACHE * sizeof (struct class_entry));
+      if (data->classes == NULL)
+	return NULL;
+      memset (data->classes, 0, CLASS_CACHE * sizeof (struct class_entry));
+    }
+  entry = &data->classes[node_hash (node) & (CLASS_CACHE - 1)];
+  if (entry->node == node && entry->len == len
+      && memcmp (entry->value, value, len) == 0)
+    return entry;
+  return class_entry_fill (entry, node, value, len);
+}
+
+/* Free the cache allocated by class_lookup() */
+static void
+class_cache_free (struct class_entry *classes)
+{
+  int i;
+
+  if (classes == NULL)
+    return;
+  for (i = 0; i < CLASS_CACHE; i++)
+    class_entry_clear (&classes[i]);
+  xmlFree (classes);
+}
+
+/* Return the text of an attribute, element or text node which may be
+   cached against the node, or NULL */
+static const xmlChar *
+node_text (const xmlNode *node)
+{
+  switch (node->type)
+    {
+    case XML_TEXT_NODE:
+      return node->content;
+    case XML_ATTRIBUTE_NODE:
+    case XML_ELEMENT_NODE:
+      if (node->children == NULL)
+	return cX"";
+      if (node->children->next == NULL
+	  && node->children->type == XML_TEXT_NODE)
+	return node->children->content;
+      return NULL;
+    default:
+      return NULL;
+    }
+}
+
 /****************************************************************************
  * boolean str:class-match(string,string)
  *	return true if the 2nd argument matches any of the space-separated
@@ -216,8 +1795,13 @@ class_match (const char *class, const char *name)
 static void
 fn_class_match (xmlXPathParserContextPtr ctxt, int nargs)
 {
-  char *name, *class;
-  int ret;
+  struct fn_ctxt *data;
+  struct class_entry *entry;
+  xmlXPathObject *obj;
+  const xmlNode *node;
+  const xmlChar *text;
+  xmlChar *name, *class;
+  int ret, nlen;
 
   if (nargs != 2)
     {
@@ -227,11 +1811,44 @@ fn_class_match (xmlXPathParserContextPtr ctxt, int nargs)
       return;
     }
 
-  name = (char *) xmlXPathPopString (ctxt);
-  class = (char *) xmlXPathPopString (ctxt);
-  ret = class_match (class, name);
+  name = xmlXPathPopString (ctxt);
+  obj = valuePop (ctxt);
+  if (name == NULL || obj == NULL)
+    {
+      xmlFree (name);
+      xmlXPathFreeObject (obj);
+      xmlXPathErr (ctxt, XPATH_INVALID_OPERAND);
+      return;
+    }
+
+  /* cache the tokens of a node, usually a class attribute */
+  node = NULL;
+  text = NULL;
+  if (obj->type == XPATH_NODESET && obj->nodesetval != NULL
+      && obj->nodesetval->nodeNr > 0)
+    {
+      if (obj->nodesetval->nodeNr > 1)
+	xmlXPathNodeSetSort (obj->nodesetval);
+      node = obj->nodesetval->nodeTab[0];
+      text = node_text (node);
+    }
+
+  nlen = strlen ((const char *) name);
+  if (text != NULL && (data = fn_get_ctxt (ctxt)) != NULL
+      && (entry = class_lookup (data, node, text,
+				strlen ((const char *) text))) != NULL)
+    ret = class_entry_match (entry, name, nlen);
+  else if (text != NULL)
+    ret = class_match (text, name, nlen);
+  else
+    {
+      class = xmlXPathCastToString (obj);
+      ret = class != NULL && class_match (class, name, nlen);
+      xmlFree (class);
+    }
+
+  xmlXPathFreeObject (obj);
   xmlFree (name);
-  xmlFree (class);
   xmlXPathReturnBoolean (ctxt, ret);
 }
 
@@ -277,20 +1894,110 @@ fn_cond_if (xmlXPathParserContextPtr ctxt, int nargs)
     }
 }
 
+/****************************************************************************
+ * obj if-expr(obj,string?,string)
+ * As if() but the second and final arguments are XPath expressions and only
+ * the one selected is evaluated, in the current context.  The expressions
+ * are compiled once and cached for the transformation, as for string-join().
+ ****************************************************************************/
+static void
+fn_cond_if_expr (xmlXPathParserContextPtr ctxt, int nargs)
+{
+  xmlXPathContext *xpctxt = ctxt->context;
+  xmlXPathObjectPtr cond, ret;
+  xmlXPathCompExpr *comp;
+  xmlChar *if_true, *if_false, *expr;
+  xmlNode *node;
+  int size, position, cached;
+
+  if (nargs < 2 || nargs > 3)
+    {
+      xmlGenericError (xmlGenericErrorContext,
+		       "if-expr() requires 2 or 3 arguments\n");
+      ctxt->error = XPATH_INVALID_ARITY;
+      return;
+    }
+
+  if_false = xmlXPathPopString (ctxt);
+  if_true = (nargs == 3) ? xmlXPathPopString (ctxt) : NULL;
+  cond = valuePop (ctxt);
+  if (ctxt->error != XPATH_EXPRESSION_OK || cond == NULL)
+    {
+      xmlXPathFreeObject (cond);
+      xmlFree (if_true);
+      xmlFree (if_false);
+      return;
+    }
+
+  if (!xmlXPathCastToBoolean (cond))
+    expr = if_false;
+  else if (if_true != NULL)
+    expr = if_true;
+  else
+    {
+      valuePush (ctxt, cond);
+      xmlFree (if_false);
+      return;
+    }
+  xmlXPathFreeObject (cond);
+
+  if ((comp = fn_compile (ctxt, expr, &cached)) == NULL)
+    {
+      xmlXPathErr (ctxt, XPATH_EXPR_ERROR);
+      xmlFree (if_true);
+      xmlFree (if_false);
+      return;
+    }
+
+  node = xpctxt->node;
+  size = xpctxt->contextSize;
+  position = xpctxt->proximityPosition;
+  ret = xmlXPathCompiledEval (comp, xpctxt);
+  xpctxt->node = node;
+  xpctxt->contextSize = size;
+  xpctxt->proximityPosition = position;
+
+  if (ret != NULL)
+    valuePush (ctxt, ret);
+  else
+    xmlXPathErr (ctxt, XPATH_EXPR_ERROR);
+  if (!cached)
+    xmlXPathFreeCompExpr (comp);
+  xmlFree (if_true);
+  xmlFree (if_false);
+}
+
 /****************************************************************************/
 
 void
 xsltFunctionsRegister (void)
 {
-  xsltRegisterExtModuleFunction (cX"base-uri", XSLT_FUNCTIONS_NAMESPACE,
-  				 fn_base_uri);
-  xsltRegisterExtModuleFunction (cX"resolve-uri", XSLT_FUNCTIONS_NAMESPACE,
-  				 fn_resolve_uri);
-  xsltRegisterExtModuleFunction (cX"string-join", XSLT_FUNCTIONS_NAMESPACE,
-  				 fn_string_join);
-  xsltRegisterExtModuleFunction (cX"ends-with", XSLT_FUNCTIONS_NAMESPACE,
-  				 fn_ends_with);
-  xsltRegisterExtModuleFunction (cX"class-match", XSLT_FUNCTIONS_NAMESPACE,
-  				 fn_class_match);
-  xsltRegisterExtModuleFunction (cX"if", XSLT_FUNCTIONS_NAMESPACE, fn_cond_if);
+  xsltRegisterExtModuleFull (XSLT_FUNCTIONS_NAMESPACE,
+			     fn_ctxt_init, fn_ctxt_shutdown, NULL, NULL);
+  stats_init (XSLT_FUNCTIONS_NAMESPACE);
+  stats_register_function (cX"base-uri", XSLT_FUNCTIONS_NAMESPACE,
+			   fn_base_uri);
+  stats_register_function (cX"resolve-uri", XSLT_FUNCTIONS_NAMESPACE,
+			   fn_resolve_uri);
+  stats_register_function (cX"resolve-uris", XSLT_FUNCTIONS_NAMESPACE,
+			   fn_resolve_uris);
+  stats_register_function (cX"uri-scheme", XSLT_FUNCTIONS_NAMESPACE,
+			   fn_uri_scheme);
+  stats_register_function (cX"uri-host", XSLT_FUNCTIONS_NAMESPACE,
+			   fn_uri_host);
+  stats_register_function (cX"uri-path", XSLT_FUNCTIONS_NAMESPACE,
+			   fn_uri_path);
+  stats_register_function (cX"uri-query-param", XSLT_FUNCTIONS_NAMESPACE,
+			   fn_uri_query_param);
+  stats_register_function (cX"uri-normalize", XSLT_FUNCTIONS_NAMESPACE,
+			   fn_uri_normalize);
+  stats_register_function (cX"string-join", XSLT_FUNCTIONS_NAMESPACE,
+			   fn_string_join);
+  stats_register_function (cX"ends-with", XSLT_FUNCTIONS_NAMESPACE,
+			   fn_ends_with);
+  stats_register_function (cX"class-match", XSLT_FUNCTIONS_NAMESPACE,
+			   fn_class_match);
+  stats_register_function (cX"if", XSLT_FUNCTIONS_NAMESPACE, fn_cond_if);
+  stats_register_function (cX"if-expr", XSLT_FUNCTIONS_NAMESPACE,
+			   fn_cond_if_expr);
 }
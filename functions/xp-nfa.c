@@ -0,0 +1,2393 @@
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <libxml/xmlmemory.h>
+
+#include "xp-nfa.h"
+
+/****************************************************************************
+ * A linear time matcher for Posix extended regular expressions.
+ *
+ * The pattern is parsed to a syntax tree and compiled to a program for a
+ * Thompson NFA.  When submatches are required the program is run as a
+ * Pike VM which tracks the submatch positions in each thread.  When only
+ * a yes/no answer is needed, DFA states are constructed lazily from sets
+ * of NFA threads and cached, so that the common case needs just a table
+ * lookup per input character.  In neither case is there any backtracking
+ * and the time taken is linear in the length of the string.
+ *
+ * Overall matches are leftmost-longest as required by Posix.  Submatches
+ * follow the usual greedy rules, preferring the first alternative, which
+ * agree with Posix for all but contrived patterns.  Back references are
+ * not supported since they cannot be matched in linear time.
+ *
+ * With NFA_UTF8 the pattern and strings are decoded as UTF-8 and each
+ * instruction consumes a whole character, match positions remain byte
+ * offsets.  Characters are decoded as they are read, ASCII characters
+ * needing no more than a test of the top bit.  Case is folded using the
+ * Unicode simple case folding.
+ ****************************************************************************/
+
+#define MAX_INST	32768	/* limit on the size of the program */
+#define MAX_DEPTH	1000	/* limit on the nesting of groups and repeats */
+#define DFA_MAX_STATES	256	/* DFA states retained before flushing */
+#define DFA_HASH	256	/* DFA state hash buckets, power of 2 */
+#define LIT_MAX		32	/* longest literal retained by the analysis */
+#define LIT_PATTERN_MAX	1024	/* longest pattern which is analysed */
+#define UNICODE_MAX	0x10ffff	/* largest character with NFA_UTF8 */
+
+/* Not clear if xmlFree() is safe for NULL pointers */
+static inline void
+xmlSafeFree (void *ptr)
+{
+  if (ptr != NULL)
+    xmlFree (ptr);
+}
+
+/* syntax tree node types */
+enum
+  {
+    N_EMPTY, N_CHAR, N_ANY, N_CLASS, N_ASSERT, N_CAT, N_ALT, N_REPEAT, N_GROUP,
+  };
+
+/* instructions */
+enum
+  {
+    I_CHAR, I_ANY, I_ANYNL, I_CLASS, I_ASSERT, I_SPLIT, I_JMP, I_SAVE, I_MATCH,
+  };
+
+/* zero width assertions */
+enum
+  {
+    A_BOL, A_EOL, A_BOS, A_EOS, A_WORDB, A_NWORDB, A_WBEGIN, A_WEND,
+  };
+
+/* context bits for evaluating assertions, the P_ bits depend on the
+   preceding character and the N_ bits on the following character */
+#define P_BOL		0x01
+#define P_BOS		0x02
+#define P_WORD		0x04
+#define N_EOL		0x10
+#define N_EOS		0x20
+#define N_WORD		0x40
+
+struct node
+  {
+    int type;
+    int x;			/* character, class, assertion or group */
+    int min, max;		/* repeat counts, max < 0 is unbounded */
+    int left, right;
+    int depth;			/* nesting of the code generator */
+  };
+
+/* Characters below 256 are held in the bitmap, larger characters in a
+   sorted list of ranges in a pool shared by all the classes */
+struct cclass
+  {
+    uint32_t bits[256 / 32];
+    int range, nrange;
+  };
+
+struct crange
+  {
+    int lo, hi;
+  };
+
+struct inst
+  {
+    int op;
+    int x, y;
+  };
+
+struct parser
+  {
+    const unsigned char *p;
+    int cflags;
+    int depth;
+    int error;
+    int ngroup;
+    struct node *node;
+    int nnode, anode;
+    struct cclass *cclass;
+    int nclass, aclass;
+    struct crange *range;
+    int nrange, arange;
+  };
+
+struct tlist
+  {
+    int n;
+    int *pc;
+    int *caps;
+  };
+
+struct job
+  {
+    int pc;
+    int slot, value;		/* restore caps[slot] when slot >= 0 */
+  };
+
+struct dstate
+  {
+    struct dstate *hnext;
+    unsigned int hash;
+    int ctx;			/* P_ context bits */
+    int nseed;
+    int *seed;			/* sorted NFA threads to be expanded */
+    int match_end[2];		/* match at end of string, per REG_NOTEOL */
+    int *match;			/* match before consuming a character class */
+    struct dstate **next;	/* transition on a character class */
+  };
+
+struct nfa
+  {
+    int cflags;
+    size_t nsub;
+    int ninst;
+    struct inst *inst;
+    int nclass;
+    struct cclass *cclass;
+    struct crange *range;
+
+    /* equivalence classes of characters for the DFA transition tables,
+       characters from 256 are divided into intervals starting at ustart */
+    int bclass[256];
+    int nbclass;
+    int nuclass;
+    int *ustart, *uclass;
+
+    /* scratch space shared by the Pike VM and the DFA */
+    int *mark;
+    int gen;
+    struct job *stack;
+    int *seed;
+
+    /* Pike VM thread lists */
+    int nslots;
+    struct tlist list[2];
+    int *caps, *best;
+
+    /* DFA state cache */
+    struct dstate *bucket[DFA_HASH];
+    int nstates;
+  };
+
+/****************************************************************************
+ * Character handling
+ ****************************************************************************/
+
+/* Decode the UTF-8 sequence at s.  Malformed sequences are taken to be a
+   single byte with the byte's value. */
+static int
+utf8_decode (const unsigned char *s, int *len)
+{
+  int c, n, i, min;
+
+  c = s[0];
+  if (c >= 0xc0 && c < 0xe0)
+    n = 1, c &= 0x1f, min = 0x80;
+  else if (c >= 0xe0 && c < 0xf0)
+    n = 2, c &= 0x0f, min = 0x800;
+  else if (c >= 0xf0 && c < 0xf8)
+    n = 3, c &= 0x07, min = 0x10000;
+  else
+    goto malformed;
+  for (i = 1; i <= n; i++)
+    {
+      if ((s[i] & 0xc0) != 0x80)
+	goto malformed;
+      c = (c << 6) | (s[i] & 0x3f);
+    }
+  if (c < min || c > UNICODE_MAX)
+    goto malformed;
+  *len = n + 1;
+  return c;
+
+malformed:
+  *len = 1;
+  return s[0];
+}
+
+static int
+utf8_encode (int c, unsigned char *s)
+{
+  if (c < 0x80)
+    {
+      s[0] = c;
+      return 1;
+    }
+  if (c < 0x800)
+    {
+      s[0] = 0xc0 | (c >> 6);
+      s[1] = 0x80 | (c & 0x3f);
+      return 2;
+    }
+  if (c < 0x10000)
+    {
+      s[0] = 0xe0 | (c >> 12);
+      s[1] = 0x80 | ((c >> 6) & 0x3f);
+      s[2] = 0x80 | (c & 0x3f);
+      return 3;
+    }
+  s[0] = 0xf0 | (c >> 18);
+  s[1] = 0x80 | ((c >> 12) & 0x3f);
+  s[2] = 0x80 | ((c >> 6) & 0x3f);
+  s[3] = 0x80 | (c & 0x3f);
+  return 4;
+}
+
+/* Return the character at s setting *len to its length in bytes */
+static inline int
+get_char (int cflags, const unsigned char *s, int *len)
+{
+  if (s[0] < 0x80 || !(cflags & NFA_UTF8))
+    {
+      *len = 1;
+      return s[0];
+    }
+  return utf8_decode (s, len);
+}
+
+/* Unicode simple case folding, from the entries of CaseFolding.txt for
+   Unicode 14.0 with status C or S.  Characters from lo to hi, in steps
+   of stride, fold to the character plus delta. */
+static const struct
+  {
+    int lo, hi, delta, stride;
+  }
+fold_table[] =
+  {
+    { 0x0041, 0x005a, 32, 1 },
+    { 0x00b5, 0x00b5, 775, 1 },
+    { 0x00c0, 0x00d6, 32, 1 },
+    { 0x00d8, 0x00de, 32, 1 },
+    { 0x0100, 0x012e, 1, 2 },
+    { 0x0132, 0x0136, 1, 2 },
+    { 0x0139, 0x0147, 1, 2 },
+    { 0x014a, 0x0176, 1, 2 },
+    { 0x0178, 0x0178, -121, 1 },
+    { 0x0179, 0x017d, 1, 2 },
+    { 0x017f, 0x017f, -268, 1 },
+    { 0x0181, 0x0181, 210, 1 },
+    { 0x0182, 0x0184, 1, 2 },
+    { 0x0186, 0x0186, 206, 1 },
+    { 0x0187, 0x0187, 1, 1 },
+    { 0x0189, 0x018a, 205, 1 },
+    { 0x018b, 0x018b, 1, 1 },
+    { 0x018e, 0x018e, 79, 1 },
+    { 0x018f, 0x018f, 202, 1 },
+    { 0x0190, 0x0190, 203, 1 },
+    { 0x0191, 0x0191, 1, 1 },
+    { 0x0193, 0x0193, 205, 1 },
+    { 0x0194, 0x0194, 207, 1 },
+    { 0x0196, 0x0196, 211, 1 },
+    { 0x0197, 0x0197, 209, 1 },
+    { 0x0198, 0x0198, 1, 1 },
+    { 0x019c, 0x019c, 211, 1 },
+    { 0x019d, 0x019d, 213, 1 },
+    { 0x019f, 0x019f, 214, 1 },
+    { 0x01a0, 0x01a4, 1, 2 },
+    { 0x01a6, 0x01a6, 218, 1 },
+    { 0x01a7, 0x01a7, 1, 1 },
+    { 0x01a9, 0x01a9, 218, 1 },
+    { 0x01ac, 0x01ac, 1, 1 },
+    { 0x01ae, 0x01ae, 218, 1 },
+    { 0x01af, 0x01af, 1, 1 },
+    { 0x01b1, 0x01b2, 217, 1 },
+    { 0x01b3, 0x01b5, 1, 2 },
+    { 0x01b7, 0x01b7, 219, 1 },
+    { 0x01b8, 0x01b8, 1, 1 },
+    { 0x01bc, 0x01bc, 1, 1 },
+    { 0x01c4, 0x01c4, 2, 1 },
+    { 0x01c5, 0x01c5, 1, 1 },
+    { 0x01c7, 0x01c7, 2, 1 },
+    { 0x01c8, 0x01c8, 1, 1 },
+    { 0x01ca, 0x01ca, 2, 1 },
+    { 0x01cb, 0x01db, 1, 2 },
+    { 0x01de, 0x01ee, 1, 2 },
+    { 0x01f1, 0x01f1, 2, 1 },
+    { 0x01f2, 0x01f4, 1, 2 },
+    { 0x01f6, 0x01f6, -97, 1 },
+    { 0x01f7, 0x01f7, -56, 1 },
+    { 0x01f8, 0x021e, 1, 2 },
+    { 0x0220, 0x0220, -130, 1 },
+    { 0x0222, 0x0232, 1, 2 },
+    { 0x023a, 0x023a, 10795, 1 },
+    { 0x023b, 0x023b, 1, 1 },
+    { 0x023d, 0x023d, -163, 1 },
+    { 0x023e, 0x023e, 10792, 1 },
+    { 0x0241, 0x0241, 1, 1 },
+    { 0x0243, 0x0243, -195, 1 },
+    { 0x0244, 0x0244, 69, 1 },
+    { 0x0245, 0x0245, 71, 1 },
+    { 0x0246, 0x024e, 1, 2 },
+    { 0x0345, 0x0345, 116, 1 },
+    { 0x0370, 0x0372, 1, 2 },
+    { 0x0376, 0x0376, 1, 1 },
+    { 0x037f, 0x037f, 116, 1 },
+    { 0x0386, 0x0386, 38, 1 },
+    { 0x0388, 0x038a, 37, 1 },
+    { 0x038c, 0x038c, 64, 1 },
+    { 0x038e, 0x038f, 63, 1 },
+    { 0x0391, 0x03a1, 32, 1 },
+    { 0x03a3, 0x03ab, 32, 1 },
+    { 0x03c2, 0x03c2, 1, 1 },
+    { 0x03cf, 0x03cf, 8, 1 },
+    { 0x03d0, 0x03d0, -30, 1 },
+    { 0x03d1, 0x03d1, -25, 1 },
+    { 0x03d5, 0x03d5, -15, 1 },
+    { 0x03d6, 0x03d6, -22, 1 },
+    { 0x03d8, 0x03ee, 1, 2 },
+    { 0x03f0, 0x03f0, -54, 1 },
+    { 0x03f1, 0x03f1, -48, 1 },
+    { 0x03f4, 0x03f4, -60, 1 },
+    { 0x03f5, 0x03f5, -64, 1 },
+    { 0x03f7, 0x03f7, 1, 1 },
+    { 0x03f9, 0x03f9, -7, 1 },
+    { 0x03fa, 0x03fa, 1, 1 },
+    { 0x03fd, 0x03ff, -130, 1 },
+    { 0x0400, 0x040f, 80, 1 },
+    { 0x0410, 0x042f, 32, 1 },
+    { 0x0460, 0x0480, 1, 2 },
+    { 0x048a, 0x04be, 1, 2 },
+    { 0x04c0, 0x04c0, 15, 1 },
+    { 0x04c1, 0x04cd, 1, 2 },
+    { 0x04d0, 0x052e, 1, 2 },
+    { 0x0531, 0x0556, 48, 1 },
+    { 0x10a0, 0x10c5, 7264, 1 },
+    { 0x10c7, 0x10c7, 7264, 1 },
+    { 0x10cd, 0x10cd, 7264, 1 },
+    { 0x13f8, 0x13fd, -8, 1 },
+    { 0x1c80, 0x1c80, -6222, 1 },
+    { 0x1c81, 0x1c81, -6221, 1 },
+    { 0x1c82, 0x1c82, -6212, 1 },
+    { 0x1c83, 0x1c84, -6210, 1 },
+    { 0x1c85, 0x1c85, -6211, 1 },
+    { 0x1c86, 0x1c86, -6204, 1 },
+    { 0x1c87, 0x1c87, -6180, 1 },
+    { 0x1c88, 0x1c88, 35267, 1 },
+    { 0x1c90, 0x1cba, -3008, 1 },
+    { 0x1cbd, 0x1cbf, -3008, 1 },
+    { 0x1e00, 0x1e94, 1, 2 },
+    { 0x1e9b, 0x1e9b, -58, 1 },
+    { 0x1e9e, 0x1e9e, -7615, 1 },
+    { 0x1ea0, 0x1efe, 1, 2 },
+    { 0x1f08, 0x1f0f, -8, 1 },
+    { 0x1f18, 0x1f1d, -8, 1 },
+    { 0x1f28, 0x1f2f, -8, 1 },
+    { 0x1f38, 0x1f3f, -8, 1 },
+    { 0x1f48, 0x1f4d, -8, 1 },
+    { 0x1f59, 0x1f5f, -8, 2 },
+    { 0x1f68, 0x1f6f, -8, 1 },
+    { 0x1f88, 0x1f8f, -8, 1 },
+    { 0x1f98, 0x1f9f, -8, 1 },
+    { 0x1fa8, 0x1faf, -8, 1 },
+    { 0x1fb8, 0x1fb9, -8, 1 },
+    { 0x1fba, 0x1fbb, -74, 1 },
+    { 0x1fbc, 0x1fbc, -9, 1 },
+    { 0x1fbe, 0x1fbe, -7173, 1 },
+    { 0x1fc8, 0x1fcb, -86, 1 },
+    { 0x1fcc, 0x1fcc, -9, 1 },
+    { 0x1fd8, 0x1fd9, -8, 1 },
+    { 0x1fda, 0x1fdb, -100, 1 },
+    { 0x1fe8, 0x1fe9, -8, 1 },
+    { 0x1fea, 0x1feb, -112, 1 },
+    { 0x1fec, 0x1fec, -7, 1 },
+    { 0x1ff8, 0x1ff9, -128, 1 },
+    { 0x1ffa, 0x1ffb, -126, 1 },
+    { 0x1ffc, 0x1ffc, -9, 1 },
+    { 0x2126, 0x2126, -7517, 1 },
+    { 0x212a, 0x212a, -8383, 1 },
+    { 0x212b, 0x212b, -8262, 1 },
+    { 0x2132, 0x2132, 28, 1 },
+    { 0x2160, 0x216f, 16, 1 },
+    { 0x2183, 0x2183, 1, 1 },
+    { 0x24b6, 0x24cf, 26, 1 },
+    { 0x2c00, 0x2c2f, 48, 1 },
+    { 0x2c60, 0x2c60, 1, 1 },
+    { 0x2c62, 0x2c62, -10743, 1 },
+    { 0x2c63, 0x2c63, -3814, 1 },
+    { 0x2c64, 0x2c64, -10727, 1 },
+    { 0x2c67, 0x2c6b, 1, 2 },
+    { 0x2c6d, 0x2c6d, -10780, 1 },
+    { 0x2c6e, 0x2c6e, -10749, 1 },
+    { 0x2c6f, 0x2c6f, -10783, 1 },
+    { 0x2c70, 0x2c70, -10782, 1 },
+    { 0x2c72, 0x2c72, 1, 1 },
+    { 0x2c75, 0x2c75, 1, 1 },
+    { 0x2c7e, 0x2c7f, -10815, 1 },
+    { 0x2c80, 0x2ce2, 1, 2 },
+    { 0x2ceb, 0x2ced, 1, 2 },
+    { 0x2cf2, 0x2cf2, 1, 1 },
+    { 0xa640, 0xa66c, 1, 2 },
+    { 0xa680, 0xa69a, 1, 2 },
+    { 0xa722, 0xa72e, 1, 2 },
+    { 0xa732, 0xa76e, 1, 2 },
+    { 0xa779, 0xa77b, 1, 2 },
+    { 0xa77d, 0xa77d, -35332, 1 },
+    { 0xa77e, 0xa786, 1, 2 },
+    { 0xa78b, 0xa78b, 1, 1 },
+    { 0xa78d, 0xa78d, -42280, 1 },
+    { 0xa790, 0xa792, 1, 2 },
+    { 0xa796, 0xa7a8, 1, 2 },
+    { 0xa7aa, 0xa7aa, -42308, 1 },
+    { 0xa7ab, 0xa7ab, -42319, 1 },
+    { 0xa7ac, 0xa7ac, -42315, 1 },
+    { 0xa7ad, 0xa7ad, -42305, 1 },
+    { 0xa7ae, 0xa7ae, -42308, 1 },
+    { 0xa7b0, 0xa7b0, -42258, 1 },
+    { 0xa7b1, 0xa7b1, -42282, 1 },
+    { 0xa7b2, 0xa7b2, -42261, 1 },
+    { 0xa7b3, 0xa7b3, 928, 1 },
+    { 0xa7b4, 0xa7c2, 1, 2 },
+    { 0xa7c4, 0xa7c4, -48, 1 },
+    { 0xa7c5, 0xa7c5, -42307, 1 },
+    { 0xa7c6, 0xa7c6, -35384, 1 },
+    { 0xa7c7, 0xa7c9, 1, 2 },
+    { 0xa7d0, 0xa7d0, 1, 1 },
+    { 0xa7d6, 0xa7d8, 1, 2 },
+    { 0xa7f5, 0xa7f5, 1, 1 },
+    { 0xab70, 0xabbf, -38864, 1 },
+    { 0xff21, 0xff3a, 32, 1 },
+    { 0x10400, 0x10427, 40, 1 },
+    { 0x104b0, 0x104d3, 40, 1 },
+    { 0x10570, 0x1057a, 39, 1 },
+    { 0x1057c, 0x1058a, 39, 1 },
+    { 0x1058c, 0x10592, 39, 1 },
+    { 0x10594, 0x10595, 39, 1 },
+    { 0x10c80, 0x10cb2, 64, 1 },
+    { 0x118a0, 0x118bf, 32, 1 },
+    { 0x16e40, 0x16e5f, 32, 1 },
+    { 0x1e900, 0x1e921, 34, 1 },
+  };
+
+#define NFOLD	((int) (sizeof fold_table / sizeof fold_table[0]))
+
+static int
+unicode_fold (int c)
+{
+  int lo, hi, mid;
+
+  lo = 0;
+  hi = NFOLD - 1;
+  while (lo <= hi)
+    {
+      mid = (lo + hi) / 2;
+      if (c < fold_table[mid].lo)
+	hi = mid - 1;
+      else if (c > fold_table[mid].hi)
+	lo = mid + 1;
+      else
+	return (c - fold_table[mid].lo) % fold_table[mid].stride == 0
+	       ? c + fold_table[mid].delta : c;
+    }
+  return c;
+}
+
+static inline int
+fold_char (int cflags, int c)
+{
+  if (!(cflags & REG_ICASE))
+    return c;
+  if (c < 0x80 || !(cflags & NFA_UTF8))
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+  return unicode_fold (c);
+}
+
+static inline int
+fold (const nfa_t *nfa, int c)
+{
+  return fold_char (nfa->cflags, c);
+}
+
+static inline int
+is_word (int c)
+{
+  return c < 0x80 && (isalnum (c) || c == '_');
+}
+
+static inline int
+class_test (const struct cclass *cl, const struct crange *range, int c)
+{
+  int lo, hi, mid;
+
+  if (c < 256)
+    return (cl->bits[c >> 5] >> (c & 31)) & 1;
+  range += cl->range;
+  lo = 0;
+  hi = cl->nrange - 1;
+  while (lo <= hi)
+    {
+      mid = (lo + hi) / 2;
+      if (c < range[mid].lo)
+	hi = mid - 1;
+      else if (c > range[mid].hi)
+	lo = mid + 1;
+      else
+	return 1;
+    }
+  return 0;
+}
+
+static inline void
+class_set (struct cclass *cl, int c)
+{
+  cl->bits[c >> 5] |= (uint32_t) 1 << (c & 31);
+}
+
+/* Context bits derived from the character before the current position,
+   c < 0 at the start of the string. */
+static inline int
+prev_context (const nfa_t *nfa, int c, int eflags)
+{
+  int ctx;
+
+  if (c < 0)
+    return P_BOS | ((eflags & REG_NOTBOL) ? 0 : P_BOL);
+  ctx = 0;
+  if (c == '\n' && (nfa->cflags & REG_NEWLINE))
+    ctx |= P_BOL;
+  if (is_word (c))
+    ctx |= P_WORD;
+  return ctx;
+}
+
+/* Context bits derived from the character at the current position,
+   c == 0 at the end of the string. */
+static inline int
+next_context (const nfa_t *nfa, int c, int eflags)
+{
+  int ctx;
+
+  if (c == 0)
+    return N_EOS | ((eflags & REG_NOTEOL) ? 0 : N_EOL);
+  ctx = 0;
+  if (c == '\n' && (nfa->cflags & REG_NEWLINE))
+    ctx |= N_EOL;
+  if (is_word (c))
+    ctx |= N_WORD;
+  return ctx;
+}
+
+static int
+check_assert (int kind, int ctx)
+{
+  switch (kind)
+    {
+    case A_BOL:
+      return (ctx & P_BOL) != 0;
+    case A_EOL:
+      return (ctx & N_EOL) != 0;
+    case A_BOS:
+      return (ctx & P_BOS) != 0;
+    case A_EOS:
+      return (ctx & N_EOS) != 0;
+    case A_WORDB:
+      return !(ctx & P_WORD) != !(ctx & N_WORD);
+    case A_NWORDB:
+      return !(ctx & P_WORD) == !(ctx & N_WORD);
+    case A_WBEGIN:
+      return !(ctx & P_WORD) && (ctx & N_WORD);
+    case A_WEND:
+      return (ctx & P_WORD) && !(ctx & N_WORD);
+    }
+  return 0;
+}
+
+/* Test whether a consuming instruction accepts the character c, fc is
+   the case folded character. */
+static inline int
+accepts (const nfa_t *nfa, const struct inst *inst, int c, int fc)
+{
+  switch (inst->op)
+    {
+    case I_CHAR:
+      return fc == inst->x;
+    case I_ANY:
+      return 1;
+    case I_ANYNL:
+      return c != '\n';
+    case I_CLASS:
+      return class_test (&nfa->cclass[inst->x], nfa->range, fc);
+    }
+  return 0;
+}
+
+/* Return the DFA transition table index for character c */
+static inline int
+char_class (const nfa_t *nfa, int c)
+{
+  int lo, hi, mid;
+
+  if (c < 256)
+    return nfa->bclass[c];
+  lo = 0;
+  hi = nfa->nuclass - 1;
+  while (lo < hi)
+    {
+      mid = (lo + hi + 1) / 2;
+      if (nfa->ustart[mid] <= c)
+	lo = mid;
+      else
+	hi = mid - 1;
+    }
+  return nfa->uclass[lo];
+}
+
+/* Start a new generation of marks for visited instructions */
+static inline void
+next_gen (nfa_t *nfa)
+{
+  if (nfa->gen == INT_MAX)
+    {
+      memset (nfa->mark, 0, nfa->ninst * sizeof (int));
+      nfa->gen = 0;
+    }
+  nfa->gen++;
+}
+
+/****************************************************************************
+ * Parser
+ ****************************************************************************/
+
+static int parse_alt (struct parser *ps);
+
+static int
+new_node (struct parser *ps, int type, int x, int left, int right)
+{
+  struct node *node;
+
+  if (ps->error)
+    return -1;
+  /* nearly every node other than a concatenation emits an instruction,
+     so a huge pattern fails here rather than in code generation */
+  if (ps->nnode >= 2 * MAX_INST)
+    {
+      ps->error = REG_ESPACE;
+      return -1;
+    }
+  if (ps->nnode >= ps->anode)
+    {
+      int anode = ps->anode > 0 ? 2 * ps->anode : 32;
+
+      if ((node = xmlRealloc (ps->node, anode * sizeof (struct node))) == NULL)
+	{
+	  ps->error = REG_ESPACE;
+	  return -1;
+	}
+      ps->node = node;
+      ps->anode = anode;
+    }
+  node = &ps->node[ps->nnode];
+  node->type = type;
+  node->x = x;
+  node->min = node->max = 1;
+  node->left = left;
+  node->right = right;
+  /* the generator recurses on every operand but those continuing the
+     left-deep chains of concatenations and alternations */
+  node->depth = 0;
+  if (left >= 0)
+    node->depth = ps->node[left].depth
+		  + !(ps->node[left].type == type
+		      && (type == N_CAT || type == N_ALT));
+  if (right >= 0 && ps->node[right].depth + 1 > node->depth)
+    node->depth = ps->node[right].depth + 1;
+  if (node->depth > MAX_DEPTH)
+    {
+      ps->error = REG_ESPACE;
+      return -1;
+    }
+  return ps->nnode++;
+}
+
+static struct cclass *
+new_class (struct parser *ps)
+{
+  struct cclass *cl;
+
+  if (ps->nclass >= ps->aclass)
+    {
+      int aclass = ps->aclass > 0 ? 2 * ps->aclass : 8;
+
+      if ((cl = xmlRealloc (ps->cclass, aclass * sizeof (struct cclass))) == NULL)
+	{
+	  ps->error = REG_ESPACE;
+	  return NULL;
+	}
+      ps->cclass = cl;
+      ps->aclass = aclass;
+    }
+  cl = &ps->cclass[ps->nclass++];
+  memset (cl, 0, sizeof (struct cclass));
+  cl->range = ps->nrange;
+  return cl;
+}
+
+/* Add characters lo to hi to the class, which must be the most recently
+   created since its ranges are at the end of the pool */
+static int
+class_add (struct parser *ps, struct cclass *cl, int lo, int hi)
+{
+  struct crange *range;
+
+  for (; lo <= hi && lo < 256; lo++)
+    class_set (cl, lo);
+  if (lo > hi)
+    return 0;
+  if (ps->nrange >= ps->arange)
+    {
+      int arange = ps->arange > 0 ? 2 * ps->arange : 16;
+
+      if ((range = xmlRealloc (ps->range,
+			       arange * sizeof (struct crange))) == NULL)
+	{
+	  ps->error = REG_ESPACE;
+	  return -1;
+	}
+      ps->range = range;
+      ps->arange = arange;
+    }
+  ps->range[ps->nrange].lo = lo;
+  ps->range[ps->nrange].hi = hi;
+  ps->nrange++;
+  cl->nrange++;
+  return 0;
+}
+
+static int
+range_cmp (const void *a, const void *b)
+{
+  return ((const struct crange *) a)->lo - ((const struct crange *) b)->lo;
+}
+
+/* Sort and merge the class's ranges */
+static void
+class_sort (struct parser *ps, struct cclass *cl)
+{
+  struct crange *range = ps->range + cl->range;
+  int i, n;
+
+  if (cl->nrange == 0)
+    return;
+  qsort (range, cl->nrange, sizeof (struct crange), range_cmp);
+  for (i = 1, n = 0; i < cl->nrange; i++)
+    if (range[i].lo <= range[n].hi + 1)
+      {
+	if (range[i].hi > range[n].hi)
+	  range[n].hi = range[i].hi;
+      }
+    else
+      range[++n] = range[i];
+  cl->nrange = n + 1;
+  ps->nrange = cl->range + cl->nrange;
+}
+
+/* Add the case folded equivalent of each character in the class */
+static int
+class_fold (struct parser *ps, struct cclass *cl)
+{
+  struct cclass orig;
+  int i, c, fc;
+
+  if (!(ps->cflags & NFA_UTF8))
+    {
+      for (c = 'A'; c <= 'Z'; c++)
+	if (class_test (cl, ps->range, c))
+	  class_set (cl, c - 'A' + 'a');
+      return 0;
+    }
+  /* test against the original ranges while folded ones are appended,
+     characters which fold are never the result of folding */
+  class_sort (ps, cl);
+  orig = *cl;
+  for (i = 0; i < NFOLD; i++)
+    for (c = fold_table[i].lo; c <= fold_table[i].hi; c += fold_table[i].stride)
+      if (class_test (&orig, ps->range, c))
+	{
+	  fc = c + fold_table[i].delta;
+	  if (class_add (ps, cl, fc, fc) < 0)
+	    return -1;
+	}
+  class_sort (ps, cl);
+  return 0;
+}
+
+/* Apply case folding and negation to a class and return a class node.
+   A non-matching list does not match newline with REG_NEWLINE. */
+static int
+finish_class (struct parser *ps, struct cclass *cl, int negate, int list)
+{
+  struct crange *range;
+  int c, i, n, next;
+
+  if (ps->cflags & REG_ICASE)
+    {
+      if (class_fold (ps, cl) < 0)
+	return -1;
+    }
+  else
+    class_sort (ps, cl);
+  if (negate)
+    {
+      for (c = 0; c < 256 / 32; c++)
+	cl->bits[c] = ~cl->bits[c];
+      if (list && (ps->cflags & REG_NEWLINE))
+	cl->bits['\n' >> 5] &= ~((uint32_t) 1 << ('\n' & 31));
+      if (ps->cflags & NFA_UTF8)
+	{
+	  /* append the gaps between the ranges then replace the ranges */
+	  n = cl->nrange;
+	  next = 256;
+	  for (i = 0; i < n; i++)
+	    {
+	      range = &ps->range[cl->range + i];
+	      if (range->lo > next && class_add (ps, cl, next, range->lo - 1) < 0)
+		return -1;
+	      next = ps->range[cl->range + i].hi + 1;
+	    }
+	  if (next <= UNICODE_MAX && class_add (ps, cl, next, UNICODE_MAX) < 0)
+	    return -1;
+	  memmove (ps->range + cl->range, ps->range + cl->range + n,
+		   (cl->nrange - n) * sizeof (struct crange));
+	  cl->nrange -= n;
+	  ps->nrange = cl->range + cl->nrange;
+	}
+    }
+  return new_node (ps, N_CLASS, cl - ps->cclass, -1, -1);
+}
+
+static const struct
+  {
+    const char *name;
+    int (*test) (int);
+  }
+ctype_names[] =
+  {
+    { "alnum", isalnum },
+    { "alpha", isalpha },
+    { "blank", isblank },
+    { "cntrl", iscntrl },
+    { "digit", isdigit },
+    { "graph", isgraph },
+    { "lower", islower },
+    { "print", isprint },
+    { "punct", ispunct },
+    { "space", isspace },
+    { "upper", isupper },
+    { "xdigit", isxdigit },
+  };
+
+static int
+add_ctype (struct parser *ps, struct cclass *cl, const char *name, int len)
+{
+  size_t i;
+  int c;
+
+  for (i = 0; i < sizeof ctype_names / sizeof ctype_names[0]; i++)
+    if ((int) strlen (ctype_names[i].name) == len
+	&& strncmp (ctype_names[i].name, name, len) == 0)
+      {
+	for (c = 1; c < 0x80; c++)
+	  if ((*ctype_names[i].test) (c))
+	    class_set (cl, c);
+	return 0;
+      }
+  ps->error = REG_ECTYPE;
+  return -1;
+}
+
+/* Return the next character of the pattern */
+static int
+pattern_char (struct parser *ps)
+{
+  int c, len;
+
+  c = get_char (ps->cflags, ps->p, &len);
+  ps->p += len;
+  return c;
+}
+
+/* Parse a single character within a bracket expression, possibly
+   specified as a collating element or equivalence class */
+static int
+bracket_char (struct parser *ps)
+{
+  const unsigned char *p = ps->p;
+  int c, len;
+
+  if (p[0] == '[' && (p[1] == '.' || p[1] == '='))
+    {
+      c = get_char (ps->cflags, p + 2, &len);
+      if (c == '\0' || p[2 + len] != p[1] || p[3 + len] != ']')
+	{
+	  ps->error = c == '\0' ? REG_EBRACK : REG_ECOLLATE;
+	  return -1;
+	}
+      ps->p += 4 + len;
+      return c;
+    }
+  return pattern_char (ps);
+}
+
+static int
+parse_bracket (struct parser *ps)
+{
+  struct cclass *cl;
+  const unsigned char *e;
+  int negate, first, lo, hi;
+
+  if ((cl = new_class (ps)) == NULL)
+    return -1;
+  ps->p++;
+  negate = 0;
+  if (*ps->p == '^')
+    {
+      negate = 1;
+      ps->p++;
+    }
+  for (first = 1; ; first = 0)
+    {
+      if (*ps->p == '\0')
+	{
+	  ps->error = REG_EBRACK;
+	  return -1;
+	}
+      if (*ps->p == ']' && !first)
+	{
+	  ps->p++;
+	  break;
+	}
+      if (ps->p[0] == '[' && ps->p[1] == ':')
+	{
+	  if ((e = (const unsigned char *) strstr ((const char *) ps->p + 2,
+						   ":]")) == NULL)
+	    {
+	      ps->error = REG_EBRACK;
+	      return -1;
+	    }
+	  if (add_ctype (ps, cl, (const char *) ps->p + 2, e - ps->p - 2) < 0)
+	    return -1;
+	  ps->p = e + 2;
+	  continue;
+	}
+      if ((lo = bracket_char (ps)) < 0)
+	return -1;
+      hi = lo;
+      if (ps->p[0] == '-' && ps->p[1] != ']' && ps->p[1] != '\0')
+	{
+	  ps->p++;
+	  if ((hi = bracket_char (ps)) < 0)
+	    return -1;
+	  if (hi < lo)
+	    {
+	      ps->error = REG_ERANGE;
+	      return -1;
+	    }
+	}
+      if (class_add (ps, cl, lo, hi) < 0)
+	return -1;
+    }
+  return finish_class (ps, cl, negate, 1);
+}
+
+/* \w \W \s \S */
+static int
+escape_class (struct parser *ps, int (*test) (int), int negate)
+{
+  struct cclass *cl;
+  int c;
+
+  if ((cl = new_class (ps)) == NULL)
+    return -1;
+  for (c = 1; c < 0x80; c++)
+    if ((*test) (c) || (test == isalnum && c == '_'))
+      class_set (cl, c);
+  return finish_class (ps, cl, negate, 0);
+}
+
+static int
+parse_atom (struct parser *ps)
+{
+  int c, n;
+
+  switch (c = *ps->p)
+    {
+    case '(':
+      ps->p++;
+      if (ps->depth >= MAX_DEPTH)
+	{
+	  ps->error = REG_ESPACE;
+	  return -1;
+	}
+      c = ++ps->ngroup;
+      ps->depth++;
+      n = parse_alt (ps);
+      ps->depth--;
+      if (ps->error)
+	return -1;
+      if (*ps->p != ')')
+	{
+	  ps->error = REG_EPAREN;
+	  return -1;
+	}
+      ps->p++;
+      return new_node (ps, N_GROUP, c, n, -1);
+    case '.':
+      ps->p++;
+      return new_node (ps, N_ANY, 0, -1, -1);
+    case '^':
+      ps->p++;
+      return new_node (ps, N_ASSERT, A_BOL, -1, -1);
+    case '$':
+      ps->p++;
+      return new_node (ps, N_ASSERT, A_EOL, -1, -1);
+    case '[':
+      return parse_bracket (ps);
+    case '*':
+    case '+':
+    case '?':
+    case '{':
+      ps->error = REG_BADRPT;
+      return -1;
+    case '\\':
+      ps->p++;
+      switch (c = pattern_char (ps))
+	{
+	case '\0':
+	  ps->error = REG_EESCAPE;
+	  return -1;
+	case 'w':
+	case 'W':
+	  return escape_class (ps, isalnum, c == 'W');
+	case 's':
+	case 'S':
+	  return escape_class (ps, isspace, c == 'S');
+	case 'b':
+	  return new_node (ps, N_ASSERT, A_WORDB, -1, -1);
+	case 'B':
+	  return new_node (ps, N_ASSERT, A_NWORDB, -1, -1);
+	case '<':
+	  return new_node (ps, N_ASSERT, A_WBEGIN, -1, -1);
+	case '>':
+	  return new_node (ps, N_ASSERT, A_WEND, -1, -1);
+	case '`':
+	  return new_node (ps, N_ASSERT, A_BOS, -1, -1);
+	case '\'':
+	  return new_node (ps, N_ASSERT, A_EOS, -1, -1);
+	}
+      if (c >= '1' && c <= '9')
+	{
+	  /* back references can't be matched in linear time */
+	  ps->error = REG_BADPAT;
+	  return -1;
+	}
+      break;
+    default:
+      c = pattern_char (ps);
+      break;
+    }
+  return new_node (ps, N_CHAR, c, -1, -1);
+}
+
+static int
+parse_number (struct parser *ps)
+{
+  int n;
+
+  if (!isdigit (*ps->p))
+    return -1;
+  for (n = 0; isdigit (*ps->p); ps->p++)
+    if ((n = n * 10 + *ps->p - '0') > RE_DUP_MAX)
+      n = RE_DUP_MAX + 1;
+  return n;
+}
+
+static int
+parse_piece (struct parser *ps)
+{
+  int atom, min, max;
+
+  atom = parse_atom (ps);
+  while (!ps->error)
+    {
+      switch (*ps->p)
+	{
+	case '*':
+	  min = 0, max = -1;
+	  break;
+	case '+':
+	  min = 1, max = -1;
+	  break;
+	case '?':
+	  min = 0, max = 1;
+	  break;
+	case '{':
+	  ps->p++;
+	  if ((min = parse_number (ps)) < 0)
+	    {
+	      if (*ps->p != ',')
+		{
+		  ps->error = *ps->p == '\0' ? REG_EBRACE : REG_BADBR;
+		  return -1;
+		}
+	      min = 0;
+	    }
+	  max = min;
+	  if (*ps->p == ',')
+	    {
+	      ps->p++;
+	      max = parse_number (ps);
+	    }
+	  if (*ps->p != '}')
+	    {
+	      ps->error = *ps->p == '\0' ? REG_EBRACE : REG_BADBR;
+	      return -1;
+	    }
+	  if (min > RE_DUP_MAX || max > RE_DUP_MAX || (max >= 0 && max < min))
+	    {
+	      ps->error = REG_BADBR;
+	      return -1;
+	    }
+	  break;
+	default:
+	  return atom;
+	}
+      ps->p++;
+      if (ps->node[atom].type == N_ASSERT && ps->node[atom].x == A_BOL)
+	{
+	  ps->error = REG_BADRPT;
+	  return -1;
+	}
+      atom = new_node (ps, N_REPEAT, 0, atom, -1);
+      if (atom >= 0)
+	{
+	  ps->node[atom].min = min;
+	  ps->node[atom].max = max;
+	}
+    }
+  return -1;
+}
+
+static int
+parse_cat (struct parser *ps)
+{
+  int left, piece;
+
+  left = -1;
+  while (!ps->error && *ps->p != '\0' && *ps->p != '|'
+	 && !(*ps->p == ')' && ps->depth > 0))
+    {
+      piece = parse_piece (ps);
+      left = left < 0 ? piece : new_node (ps, N_CAT, 0, left, piece);
+    }
+  if (left < 0)
+    left = new_node (ps, N_EMPTY, 0, -1, -1);
+  return left;
+}
+
+static int
+parse_alt (struct parser *ps)
+{
+  int left, right;
+
+  left = parse_cat (ps);
+  while (!ps->error && *ps->p == '|')
+    {
+      ps->p++;
+      right = parse_cat (ps);
+      left = new_node (ps, N_ALT, 0, left, right);
+    }
+  return left;
+}
+
+/****************************************************************************
+ * Code generator
+ ****************************************************************************/
+
+static int
+emit (nfa_t *nfa, int *ainst, int op, int x, int y)
+{
+  struct inst *inst;
+
+  if (nfa->ninst >= *ainst)
+    {
+      int n = *ainst > 0 ? 2 * *ainst : 64;
+
+      if (n > MAX_INST)
+	n = MAX_INST;
+      if (nfa->ninst >= n
+	  || (inst = xmlRealloc (nfa->inst, n * sizeof (struct inst))) == NULL)
+	return -1;
+      nfa->inst = inst;
+      *ainst = n;
+    }
+  inst = &nfa->inst[nfa->ninst];
+  inst->op = op;
+  inst->x = x;
+  inst->y = y;
+  return nfa->ninst++;
+}
+
+static int
+emit_node (nfa_t *nfa, int *ainst, const struct node *tree, int n)
+{
+  const struct node *node = &tree[n];
+  int i, m, len, pc, start, split, end, error, *spine;
+
+  switch (node->type)
+    {
+    case N_EMPTY:
+      return 0;
+    case N_CHAR:
+      return emit (nfa, ainst, I_CHAR, fold (nfa, node->x), 0) < 0 ? -1 : 0;
+    case N_ANY:
+      return emit (nfa, ainst, (nfa->cflags & REG_NEWLINE) ? I_ANYNL : I_ANY,
+		   0, 0) < 0 ? -1 : 0;
+    case N_CLASS:
+      return emit (nfa, ainst, I_CLASS, node->x, 0) < 0 ? -1 : 0;
+    case N_ASSERT:
+      return emit (nfa, ainst, I_ASSERT, node->x, 0) < 0 ? -1 : 0;
+    case N_CAT:
+    case N_ALT:
+      /* both are left-deep, emit the chain from its leftmost operand
+	 rather than recursing along it */
+      for (len = 0, m = n; tree[m].type == node->type; m = tree[m].left)
+	len++;
+      if ((spine = xmlMalloc (len * sizeof (int))) == NULL)
+	return -1;
+      for (i = len, m = n; i > 0; m = tree[m].left)
+	spine[--i] = m;
+      if (node->type == N_CAT)
+	{
+	  error = emit_node (nfa, ainst, tree, m);
+	  for (i = 0; i < len && error == 0; i++)
+	    error = emit_node (nfa, ainst, tree, tree[spine[i]].right);
+	  xmlFree (spine);
+	  return error;
+	}
+      /*     split L1, L2		one split per alternative after
+	     ...			the first, outermost first
+	 L1: left
+	     jmp L3
+	 L2: right
+	     jmp L3
+	     ...
+	 L3:		*/
+      start = nfa->ninst;
+      for (i = 0; i < len; i++)
+	if (emit (nfa, ainst, I_SPLIT, nfa->ninst + 1, 0) < 0)
+	  {
+	    xmlFree (spine);
+	    return -1;
+	  }
+      error = emit_node (nfa, ainst, tree, m);
+      for (i = 0; i < len && error == 0; i++)
+	{
+	  m = tree[spine[i]].right;
+	  if ((spine[i] = emit (nfa, ainst, I_JMP, 0, 0)) < 0)
+	    error = -1;
+	  else
+	    {
+	      nfa->inst[start + len - 1 - i].y = nfa->ninst;
+	      error = emit_node (nfa, ainst, tree, m);
+	    }
+	}
+      if (error == 0)
+	for (i = 0; i < len; i++)
+	  nfa->inst[spine[i]].x = nfa->ninst;
+      xmlFree (spine);
+      return error;
+    case N_GROUP:
+      if (emit (nfa, ainst, I_SAVE, 2 * node->x, 0) < 0
+	  || emit_node (nfa, ainst, tree, node->left) < 0
+	  || emit (nfa, ainst, I_SAVE, 2 * node->x + 1, 0) < 0)
+	return -1;
+      return 0;
+    case N_REPEAT:
+      start = nfa->ninst;
+      for (i = 0; i < node->min; i++)
+	{
+	  start = nfa->ninst;
+	  if (emit_node (nfa, ainst, tree, node->left) < 0)
+	    return -1;
+	}
+      if (node->max < 0 && node->min > 0)
+	{
+	  /* L1: left
+		 split L1, L2
+	     L2:		*/
+	  return emit (nfa, ainst, I_SPLIT, start, nfa->ninst + 1) < 0 ? -1 : 0;
+	}
+      if (node->max < 0)
+	{
+	  /* L1: split L2, L3
+	     L2: left
+		 jmp L1
+	     L3:		*/
+	  if ((split = emit (nfa, ainst, I_SPLIT, 0, 0)) < 0)
+	    return -1;
+	  nfa->inst[split].x = nfa->ninst;
+	  if (emit_node (nfa, ainst, tree, node->left) < 0
+	      || emit (nfa, ainst, I_JMP, split, 0) < 0)
+	    return -1;
+	  nfa->inst[split].y = nfa->ninst;
+	  return 0;
+	}
+      /* optional copies, each split jumps to the end when not taken */
+      start = nfa->ninst;
+      for (i = node->min; i < node->max; i++)
+	{
+	  if ((split = emit (nfa, ainst, I_SPLIT, 0, -1)) < 0)
+	    return -1;
+	  nfa->inst[split].x = nfa->ninst;
+	  if (emit_node (nfa, ainst, tree, node->left) < 0)
+	    return -1;
+	}
+      end = nfa->ninst;
+      for (pc = start; pc < end; pc++)
+	if (nfa->inst[pc].op == I_SPLIT && nfa->inst[pc].y == -1)
+	  nfa->inst[pc].y = end;
+      return 0;
+    }
+  return -1;
+}
+
+static int
+int_cmp (const void *a, const void *b)
+{
+  return *(const int *) a - *(const int *) b;
+}
+
+static int
+add_bound (int **pbound, int *nbound, int *abound, int c)
+{
+  int *bound;
+
+  if (c > UNICODE_MAX)
+    return 0;
+  if (*nbound >= *abound)
+    {
+      int n = *abound > 0 ? 2 * *abound : 64;
+
+      if ((bound = xmlRealloc (*pbound, n * sizeof (int))) == NULL)
+	return -1;
+      *pbound = bound;
+      *abound = n;
+    }
+  (*pbound)[(*nbound)++] = c;
+  return 0;
+}
+
+/* Find the starts of the intervals of characters from 256 within which
+   the program can't distinguish characters.  These are the bounds of the
+   characters and class ranges in the program and, when case is ignored,
+   characters which fold to a character the program accepts. */
+static int
+char_bounds (nfa_t *nfa, int **pbound)
+{
+  const struct inst *inst;
+  const struct cclass *cl;
+  int *bound, nbound, abound, pc, i, j, c, fc;
+
+  bound = NULL;
+  nbound = abound = 0;
+  if (add_bound (&bound, &nbound, &abound, 256) < 0)
+    goto nomem;
+  for (pc = 0; pc < nfa->ninst; pc++)
+    {
+      inst = &nfa->inst[pc];
+      if (inst->op == I_CHAR && inst->x >= 256)
+	{
+	  if (add_bound (&bound, &nbound, &abound, inst->x) < 0
+	      || add_bound (&bound, &nbound, &abound, inst->x + 1) < 0)
+	    goto nomem;
+	}
+      else if (inst->op == I_CLASS)
+	{
+	  cl = &nfa->cclass[inst->x];
+	  for (i = 0; i < cl->nrange; i++)
+	    if (add_bound (&bound, &nbound, &abound,
+			   nfa->range[cl->range + i].lo) < 0
+		|| add_bound (&bound, &nbound, &abound,
+			      nfa->range[cl->range + i].hi + 1) < 0)
+	      goto nomem;
+	}
+    }
+  if (nfa->cflags & REG_ICASE)
+    for (i = 0; i < NFOLD; i++)
+      for (c = fold_table[i].lo; c <= fold_table[i].hi;
+	   c += fold_table[i].stride)
+	{
+	  if (c < 256)
+	    continue;
+	  fc = c + fold_table[i].delta;
+	  for (pc = 0; pc < nfa->ninst; pc++)
+	    if (accepts (nfa, &nfa->inst[pc], fc, fc))
+	      break;
+	  if (pc < nfa->ninst
+	      && (add_bound (&bound, &nbound, &abound, c) < 0
+		  || add_bound (&bound, &nbound, &abound, c + 1) < 0))
+	    goto nomem;
+	}
+  qsort (bound, nbound, sizeof (int), int_cmp);
+  for (i = 1, j = 0; i < nbound; i++)
+    if (bound[i] != bound[j])
+      bound[++j] = bound[i];
+  *pbound = bound;
+  return j + 1;
+
+nomem:
+  xmlSafeFree (bound);
+  return -1;
+}
+
+/* Partition the characters into classes that are indistinguishable by the
+   program so that the DFA transition tables may be indexed by class.  Each
+   character below 256 is considered individually, larger characters by
+   the intervals found by char_bounds(). */
+static int
+char_classes (nfa_t *nfa)
+{
+  unsigned char *in;
+  int *bound, *id, *newid;
+  const struct inst *inst;
+  int nbound, npoint, pc, c, i, n, key;
+
+  bound = NULL;
+  nbound = 0;
+  inst = NULL;
+  if ((nfa->cflags & NFA_UTF8) && (nbound = char_bounds (nfa, &bound)) < 0)
+    return -1;
+  npoint = 256 + nbound;
+  in = xmlMalloc (npoint);
+  id = xmlMalloc (npoint * sizeof (int));
+  newid = xmlMalloc (2 * npoint * sizeof (int));
+  if (in == NULL || id == NULL || newid == NULL)
+    goto nomem;
+
+  memset (id, 0, npoint * sizeof (int));
+  nfa->nbclass = 1;
+  for (pc = -2; pc < nfa->ninst; pc++)
+    {
+      if (pc >= 0)
+	{
+	  inst = &nfa->inst[pc];
+	  if (inst->op != I_CHAR && inst->op != I_CLASS)
+	    continue;
+	}
+      for (i = 0; i < npoint; i++)
+	{
+	  c = i < 256 ? i : bound[i - 256];
+	  if (pc == -2)
+	    in[i] = c == '\n';
+	  else if (pc == -1)
+	    in[i] = is_word (c);
+	  else
+	    in[i] = accepts (nfa, inst, c, fold (nfa, c));
+	}
+      for (i = 0; i < 2 * nfa->nbclass; i++)
+	newid[i] = -1;
+      n = 0;
+      for (i = 0; i < npoint; i++)
+	{
+	  key = 2 * id[i] + in[i];
+	  if (newid[key] < 0)
+	    newid[key] = n++;
+	  id[i] = newid[key];
+	}
+      nfa->nbclass = n;
+    }
+
+  for (c = 0; c < 256; c++)
+    nfa->bclass[c] = id[c];
+  if (nbound > 0)
+    {
+      /* adjacent intervals in the same class are merged */
+      nfa->ustart = xmlMalloc (nbound * sizeof (int));
+      nfa->uclass = xmlMalloc (nbound * sizeof (int));
+      if (nfa->ustart == NULL || nfa->uclass == NULL)
+	goto nomem;
+      for (i = 0, n = 0; i < nbound; i++)
+	if (n == 0 || id[256 + i] != nfa->uclass[n - 1])
+	  {
+	    nfa->ustart[n] = bound[i];
+	    nfa->uclass[n++] = id[256 + i];
+	  }
+      nfa->nuclass = n;
+    }
+  xmlSafeFree (bound);
+  xmlFree (in);
+  xmlFree (id);
+  xmlFree (newid);
+  return 0;
+
+nomem:
+  xmlSafeFree (bound);
+  xmlSafeFree (in);
+  xmlSafeFree (id);
+  xmlSafeFree (newid);
+  return -1;
+}
+
+/****************************************************************************
+ * Pike VM
+ ****************************************************************************/
+
+/* Add the thread at pc to the list following the empty transitions.
+   Threads are added in priority order, the first to reach an instruction
+   takes precedence.  caps is modified during the traversal but restored
+   before returning. */
+static void
+add_thread (nfa_t *nfa, struct tlist *list, int pc, int *caps, int pos,
+	    int ctx)
+{
+  struct job *stack = nfa->stack;
+  const struct inst *inst;
+  int sp, n;
+
+  sp = 0;
+  stack[sp].pc = pc;
+  stack[sp++].slot = -1;
+  while (sp > 0)
+    {
+      sp--;
+      if (stack[sp].slot >= 0)
+	{
+	  caps[stack[sp].slot] = stack[sp].value;
+	  continue;
+	}
+      pc = stack[sp].pc;
+      if (nfa->mark[pc] == nfa->gen)
+	continue;
+      nfa->mark[pc] = nfa->gen;
+      inst = &nfa->inst[pc];
+      switch (inst->op)
+	{
+	case I_JMP:
+	  stack[sp].pc = inst->x;
+	  stack[sp++].slot = -1;
+	  break;
+	case I_SPLIT:
+	  stack[sp].pc = inst->y;
+	  stack[sp++].slot = -1;
+	  stack[sp].pc = inst->x;
+	  stack[sp++].slot = -1;
+	  break;
+	case I_SAVE:
+	  if (inst->x < nfa->nslots)
+	    {
+	      stack[sp].slot = inst->x;
+	      stack[sp++].value = caps[inst->x];
+	      caps[inst->x] = pos;
+	    }
+	  stack[sp].pc = pc + 1;
+	  stack[sp++].slot = -1;
+	  break;
+	case I_ASSERT:
+	  if (check_assert (inst->x, ctx))
+	    {
+	      stack[sp].pc = pc + 1;
+	      stack[sp++].slot = -1;
+	    }
+	  break;
+	default:
+	  n = list->n++;
+	  list->pc[n] = pc;
+	  memcpy (&list->caps[n * nfa->nslots], caps,
+		  nfa->nslots * sizeof (int));
+	  break;
+	}
+    }
+}
+
+static int
+pike_alloc (nfa_t *nfa)
+{
+  int i, nslots = 2 * (nfa->nsub + 1);
+
+  if (nfa->caps != NULL)
+    return 0;
+  for (i = 0; i < 2; i++)
+    {
+      nfa->list[i].pc = xmlMalloc (nfa->ninst * sizeof (int));
+      nfa->list[i].caps = xmlMalloc (nfa->ninst * nslots * sizeof (int));
+      if (nfa->list[i].pc == NULL || nfa->list[i].caps == NULL)
+	return -1;
+    }
+  nfa->best = xmlMalloc (nslots * sizeof (int));
+  nfa->caps = xmlMalloc (nslots * sizeof (int));
+  if (nfa->best == NULL || nfa->caps == NULL)
+    return -1;
+  return 0;
+}
+
+static int
+pike_exec (nfa_t *nfa, const unsigned char *s, size_t nmatch,
+	   regmatch_t pmatch[], int eflags)
+{
+  struct tlist *clist, *nlist, *tmp;
+  const struct inst *inst;
+  int *caps, *best;
+  int pos, prev, c, fc, len, i, found, ctx, nctx;
+
+  if (pike_alloc (nfa) < 0)
+    return REG_ESPACE;
+
+  /* only track the submatches that have been asked for */
+  nfa->nslots = 2 * (nmatch < nfa->nsub + 1 ? nmatch : nfa->nsub + 1);
+  best = nfa->best;
+  clist = &nfa->list[0];
+  nlist = &nfa->list[1];
+  clist->n = 0;
+  next_gen (nfa);
+  found = 0;
+  prev = -1;
+  ctx = prev_context (nfa, prev, eflags) | next_context (nfa, s[0], eflags);
+  for (pos = 0; ; pos += len)
+    {
+      c = get_char (nfa->cflags, s + pos, &len);
+      fc = fold (nfa, c);
+
+      /* start a new thread at this position unless a match has been
+	 found, it has the lowest priority */
+      if (!found)
+	{
+	  for (i = 0; i < nfa->nslots; i++)
+	    nfa->caps[i] = -1;
+	  add_thread (nfa, clist, 0, nfa->caps, pos, ctx);
+	}
+      if (clist->n == 0 && (found || c == 0))
+	break;
+
+      next_gen (nfa);
+      nlist->n = 0;
+      /* the context bits only depend on ASCII characters so the first
+	 byte of the following character is enough */
+      nctx = c == 0 ? 0 : prev_context (nfa, c, eflags)
+			  | next_context (nfa, s[pos + len], eflags);
+      for (i = 0; i < clist->n; i++)
+	{
+	  caps = &clist->caps[i * nfa->nslots];
+
+	  /* threads starting after a match can't improve on it */
+	  if (found && caps[0] > best[0])
+	    continue;
+	  inst = &nfa->inst[clist->pc[i]];
+	  if (inst->op == I_MATCH)
+	    {
+	      /* leftmost-longest */
+	      if (!found || caps[0] < best[0]
+		  || (caps[0] == best[0] && caps[1] > best[1]))
+		{
+		  memcpy (best, caps, nfa->nslots * sizeof (int));
+		  found = 1;
+		}
+	    }
+	  else if (c != 0 && accepts (nfa, inst, c, fc))
+	    add_thread (nfa, nlist, clist->pc[i] + 1, caps, pos + len, nctx);
+	}
+      if (c == 0)
+	break;
+      tmp = clist, clist = nlist, nlist = tmp;
+      ctx = nctx;
+    }
+
+  if (!found)
+    return REG_NOMATCH;
+  for (i = 0; i < (int) nmatch; i++)
+    if (2 * i < nfa->nslots && best[2 * i] >= 0 && best[2 * i + 1] >= 0)
+      {
+	pmatch[i].rm_so = best[2 * i];
+	pmatch[i].rm_eo = best[2 * i + 1];
+      }
+    else
+      pmatch[i].rm_so = pmatch[i].rm_eo = -1;
+  return 0;
+}
+
+/****************************************************************************
+ * Lazy DFA
+ *
+ * A DFA state is the set of NFA threads waiting to be expanded at the
+ * current position together with the context bits determined by the
+ * preceding character.  Expansion is deferred until the following
+ * character is known so that assertions can be evaluated.  A new thread
+ * starting at the beginning of the program is implicitly added to every
+ * state since the search is unanchored.
+ ****************************************************************************/
+
+static void
+dfa_flush (nfa_t *nfa)
+{
+  struct dstate *state, *next;
+  int i;
+
+  for (i = 0; i < DFA_HASH; i++)
+    {
+      for (state = nfa->bucket[i]; state != NULL; state = next)
+	{
+	  next = state->hnext;
+	  xmlFree (state);
+	}
+      nfa->bucket[i] = NULL;
+    }
+  nfa->nstates = 0;
+}
+
+/* Find or create the state for a sorted set of threads */
+static struct dstate *
+dfa_state (nfa_t *nfa, const int *seed, int nseed, int ctx)
+{
+  struct dstate *state;
+  unsigned int hash;
+  size_t size;
+  int i;
+
+  hash = 2166136261u ^ ctx;
+  for (i = 0; i < nseed; i++)
+    hash = (hash ^ seed[i]) * 16777619u;
+  for (state = nfa->bucket[hash & (DFA_HASH - 1)]; state != NULL;
+       state = state->hnext)
+    if (state->hash == hash && state->ctx == ctx && state->nseed == nseed
+	&& (nseed == 0 || memcmp (state->seed, seed, nseed * sizeof (int)) == 0))
+      return state;
+
+  size = sizeof (struct dstate)
+	 + nfa->nbclass * (sizeof (struct dstate *) + sizeof (int))
+	 + nseed * sizeof (int);
+  if ((state = xmlMalloc (size)) == NULL)
+    return NULL;
+  memset (state, 0, size);
+  state->next = (struct dstate **) (state + 1);
+  state->match = (int *) (state->next + nfa->nbclass);
+  state->seed = state->match + nfa->nbclass;
+  if (nseed > 0)
+    memcpy (state->seed, seed, nseed * sizeof (int));
+  state->nseed = nseed;
+  state->ctx = ctx;
+  state->hash = hash;
+  state->match_end[0] = state->match_end[1] = -2;
+  state->hnext = nfa->bucket[hash & (DFA_HASH - 1)];
+  nfa->bucket[hash & (DFA_HASH - 1)] = state;
+  nfa->nstates++;
+  return state;
+}
+
+/* Expand the threads in the state given the context bits of the
+   following character.  The consuming instructions reached are left in
+   nfa->seed, the return value is < 0 if there is no match at this
+   position, otherwise the index of the lowest numbered pattern which
+   matches. */
+static int
+dfa_expand (nfa_t *nfa, const struct dstate *state, int ctx, int *nout)
+{
+  struct job *stack = nfa->stack;
+  const struct inst *inst;
+  int sp, pc, i, n, match;
+
+  next_gen (nfa);
+  sp = 0;
+  stack[sp++].pc = 0;
+  for (i = state->nseed; i-- > 0; )
+    stack[sp++].pc = state->seed[i];
+  n = 0;
+  match = -1;
+  while (sp > 0)
+    {
+      pc = stack[--sp].pc;
+      if (nfa->mark[pc] == nfa->gen)
+	continue;
+      nfa->mark[pc] = nfa->gen;
+      inst = &nfa->inst[pc];
+      switch (inst->op)
+	{
+	case I_JMP:
+	  stack[sp++].pc = inst->x;
+	  break;
+	case I_SPLIT:
+	  stack[sp++].pc = inst->y;
+	  stack[sp++].pc = inst->x;
+	  break;
+	case I_SAVE:
+	  stack[sp++].pc = pc + 1;
+	  break;
+	case I_ASSERT:
+	  if (check_assert (inst->x, ctx))
+	    stack[sp++].pc = pc + 1;
+	  break;
+	case I_MATCH:
+	  /* the lowest numbered pattern matched */
+	  if (match < 0 || inst->x < match)
+	    match = inst->x;
+	  break;
+	default:
+	  nfa->seed[n++] = pc;
+	  break;
+	}
+    }
+  *nout = n;
+  return match;
+}
+
+/* Compute the transition from *pstate on character c.  If the cache
+   must be flushed *pstate is replaced with an equivalent new state. */
+static struct dstate *
+dfa_step (nfa_t *nfa, struct dstate **pstate, int c, int eflags)
+{
+  struct dstate *state = *pstate, *next;
+  int i, n, nseed, match, fc, ctx, k;
+
+  if (nfa->nstates >= DFA_MAX_STATES)
+    {
+      /* keep the current state's threads at the top of the seed
+	 buffer while the cache is rebuilt */
+      n = state->nseed;
+      ctx = state->ctx;
+      memmove (nfa->seed + nfa->ninst, state->seed, n * sizeof (int));
+      dfa_flush (nfa);
+      if ((state = dfa_state (nfa, nfa->seed + nfa->ninst, n, ctx)) == NULL)
+	return NULL;
+      *pstate = state;
+    }
+
+  match = dfa_expand (nfa, state, state->ctx | next_context (nfa, c, eflags),
+		      &n);
+  fc = fold (nfa, c);
+  nseed = 0;
+  for (i = 0; i < n; i++)
+    if (accepts (nfa, &nfa->inst[nfa->seed[i]], c, fc))
+      nfa->seed[nseed++] = nfa->seed[i] + 1;
+  qsort (nfa->seed, nseed, sizeof (int), int_cmp);
+  if ((next = dfa_state (nfa, nfa->seed, nseed,
+			 prev_context (nfa, c, eflags))) == NULL)
+    return NULL;
+  k = char_class (nfa, c);
+  state->next[k] = next;
+  state->match[k] = match;
+  return next;
+}
+
+static int
+dfa_exec (nfa_t *nfa, const unsigned char *s, int eflags)
+{
+  struct dstate *state, *next;
+  int c, k, n, len, noteol;
+
+  if ((state = dfa_state (nfa, NULL, 0, prev_context (nfa, -1, eflags))) == NULL)
+    return REG_ESPACE;
+  for (; (c = get_char (nfa->cflags, s, &len)) != 0; s += len)
+    {
+      k = char_class (nfa, c);
+      if ((next = state->next[k]) == NULL
+	  && (next = dfa_step (nfa, &state, c, eflags)) == NULL)
+	return REG_ESPACE;
+      if (state->match[k] >= 0)
+	return 0;
+      state = next;
+    }
+  noteol = (eflags & REG_NOTEOL) != 0;
+  if (state->match_end[noteol] == -2)
+    state->match_end[noteol] = dfa_expand (nfa, state, state->ctx
+					   | next_context (nfa, 0, eflags), &n);
+  return state->match_end[noteol] >= 0 ? 0 : REG_NOMATCH;
+}
+
+/* As dfa_exec() but continue to the end of the string unless the first
+   pattern of a set matches, returning the lowest numbered pattern which
+   matches or -1 */
+static int
+dfa_exec_set (nfa_t *nfa, const unsigned char *s, int eflags)
+{
+  struct dstate *state, *next;
+  int c, k, n, len, noteol, best;
+
+  if ((state = dfa_state (nfa, NULL, 0, prev_context (nfa, -1, eflags))) == NULL)
+    return -2;
+  best = -1;
+  for (; (c = get_char (nfa->cflags, s, &len)) != 0; s += len)
+    {
+      k = char_class (nfa, c);
+      if ((next = state->next[k]) == NULL
+	  && (next = dfa_step (nfa, &state, c, eflags)) == NULL)
+	return -2;
+      if (state->match[k] >= 0 && (best < 0 || state->match[k] < best))
+	if ((best = state->match[k]) == 0)
+	  return 0;
+      state = next;
+    }
+  noteol = (eflags & REG_NOTEOL) != 0;
+  if (state->match_end[noteol] == -2)
+    state->match_end[noteol] = dfa_expand (nfa, state, state->ctx
+					   | next_context (nfa, 0, eflags), &n);
+  if (state->match_end[noteol] >= 0
+      && (best < 0 || state->match_end[noteol] < best))
+    best = state->match_end[noteol];
+  return best;
+}
+
+/****************************************************************************
+ * Literal analysis
+ *
+ * Find literal strings which every match must contain so that strings may
+ * be rejected with memcmp() or memmem() before running a matcher.  For each
+ * node of the syntax tree the analysis finds a prefix and a suffix common
+ * to all its matches and the longest substring known to be contained in
+ * all of them.  Where a node can only match one string it is exact and
+ * all three are that string.  Literals are truncated to LIT_MAX bytes,
+ * keeping the leading bytes of a prefix and the trailing bytes of a suffix
+ * so that they remain valid.
+ ****************************************************************************/
+
+struct lit
+  {
+    int len;
+    unsigned char s[LIT_MAX];
+  };
+
+struct lits
+  {
+    int exact;			/* the node only matches the prefix */
+    int abegin, aend;		/* matches are anchored to the string ends */
+    struct lit prefix, suffix, required;
+  };
+
+/* Concatenate a and b keeping the head or the tail of the result,
+   return non-zero if the result was truncated */
+static int
+lit_join (struct lit *out, const struct lit *a, const struct lit *b, int tail)
+{
+  unsigned char buf[2 * LIT_MAX];
+  int len;
+
+  memcpy (buf, a->s, a->len);
+  memcpy (buf + a->len, b->s, b->len);
+  len = a->len + b->len;
+  out->len = len < LIT_MAX ? len : LIT_MAX;
+  memcpy (out->s, tail ? buf + len - out->len : buf, out->len);
+  return len > LIT_MAX;
+}
+
+static const struct lit *
+lit_best (const struct lit *a, const struct lit *b)
+{
+  return b->len > a->len ? b : a;
+}
+
+static void
+lits_exact (struct lits *out, const struct lit *lit)
+{
+  out->exact = 1;
+  out->prefix = out->suffix = out->required = *lit;
+}
+
+/* A character can only be treated as a literal if its case is not
+   ignored.  Non-ASCII bytes may be part of a multibyte character which
+   the C library folds when matching, with NFA_UTF8 non-ASCII characters
+   may fold. */
+static int
+lit_char (int c, int cflags)
+{
+  return c != '\0'
+	 && !((cflags & REG_ICASE) && (c >= 0x80 || isalpha (c)));
+}
+
+/* Combine the literals of a followed by b into out, which may be a */
+static void
+lits_cat (struct lits *out, const struct lits *a, const struct lits *b)
+{
+  struct lits r;
+  struct lit lit;
+
+  memset (&r, 0, sizeof r);
+  r.abegin = a->abegin || (a->exact && a->prefix.len == 0 && b->abegin);
+  r.aend = b->aend || (b->exact && b->prefix.len == 0 && a->aend);
+  if (a->exact && b->exact && !lit_join (&lit, &a->prefix, &b->prefix, 0))
+    {
+      lits_exact (&r, &lit);
+      *out = r;
+      return;
+    }
+  if (a->exact)
+    lit_join (&r.prefix, &a->prefix, &b->prefix, 0);
+  else
+    r.prefix = a->prefix;
+  if (b->exact)
+    lit_join (&r.suffix, &a->suffix, &b->suffix, 1);
+  else
+    r.suffix = b->suffix;
+  lit_join (&lit, &a->suffix, &b->prefix, 0);
+  r.required = *lit_best (lit_best (&a->required, &b->required),
+			  lit_best (&lit, lit_best (&r.prefix, &r.suffix)));
+  *out = r;
+}
+
+/* Combine the literals of a or b into out, which may be a */
+static void
+lits_alt (struct lits *out, const struct lits *a, const struct lits *b)
+{
+  struct lits r;
+  int i;
+
+  memset (&r, 0, sizeof r);
+  r.abegin = a->abegin && b->abegin;
+  r.aend = a->aend && b->aend;
+  r.exact = a->exact && b->exact && a->prefix.len == b->prefix.len
+	    && memcmp (a->prefix.s, b->prefix.s, a->prefix.len) == 0;
+  for (i = 0; i < a->prefix.len && i < b->prefix.len
+	      && a->prefix.s[i] == b->prefix.s[i]; i++)
+    ;
+  r.prefix.len = i;
+  memcpy (r.prefix.s, a->prefix.s, i);
+  for (i = 0; i < a->suffix.len && i < b->suffix.len
+	      && a->suffix.s[a->suffix.len - i - 1]
+		 == b->suffix.s[b->suffix.len - i - 1]; i++)
+    ;
+  r.suffix.len = i;
+  memcpy (r.suffix.s, a->suffix.s + a->suffix.len - i, i);
+  r.required = *lit_best (&r.prefix, &r.suffix);
+  *out = r;
+}
+
+static void
+analyse (const struct node *tree, int n, int cflags, struct lits *out)
+{
+  const struct node *node = &tree[n];
+  struct lits a, b;
+  struct lit lit;
+  int i, m, len, *spine;
+
+  memset (out, 0, sizeof (struct lits));
+  switch (node->type)
+    {
+    case N_EMPTY:
+      lits_exact (out, &out->prefix);
+      break;
+    case N_CHAR:
+      if (lit_char (node->x, cflags))
+	{
+	  if (cflags & NFA_UTF8)
+	    lit.len = utf8_encode (node->x, lit.s);
+	  else
+	    {
+	      lit.len = 1;
+	      lit.s[0] = node->x;
+	    }
+	  lits_exact (out, &lit);
+	}
+      break;
+    case N_ANY:
+    case N_CLASS:
+      break;
+    case N_ASSERT:
+      /* matches the empty string, ^ and $ anchor to the string ends
+	 except with REG_NEWLINE */
+      lits_exact (out, &out->prefix);
+      out->abegin = node->x == A_BOS
+		    || (node->x == A_BOL && !(cflags & REG_NEWLINE));
+      out->aend = node->x == A_EOS
+		  || (node->x == A_EOL && !(cflags & REG_NEWLINE));
+      break;
+    case N_GROUP:
+      analyse (tree, node->left, cflags, out);
+      break;
+    case N_CAT:
+    case N_ALT:
+      /* both are left-deep, fold the chain from its leftmost operand
+	 rather than recursing along it */
+      for (len = 0, m = n; tree[m].type == node->type; m = tree[m].left)
+	len++;
+      if ((spine = xmlMalloc (len * sizeof (int))) == NULL)
+	break;
+      for (i = len, m = n; i > 0; m = tree[m].left)
+	spine[--i] = m;
+      analyse (tree, m, cflags, &a);
+      for (i = 0; i < len; i++)
+	{
+	  analyse (tree, tree[spine[i]].right, cflags, &b);
+	  if (node->type == N_CAT)
+	    lits_cat (&a, &a, &b);
+	  else
+	    lits_alt (&a, &a, &b);
+	}
+      xmlFree (spine);
+      *out = a;
+      break;
+    case N_REPEAT:
+      if (node->max == 0)
+	{
+	  lits_exact (out, &out->prefix);
+	  break;
+	}
+      if (node->min == 0)
+	break;
+      analyse (tree, node->left, cflags, &a);
+      out->abegin = a.abegin;
+      out->aend = a.aend;
+      if (!a.exact)
+	{
+	  out->prefix = a.prefix;
+	  out->suffix = a.suffix;
+	  out->required = a.required;
+	  break;
+	}
+      /* the minimum number of copies of an exact string */
+      lit.len = 0;
+      for (i = 0; i < node->min; i++)
+	if (lit_join (&lit, &lit, &a.prefix, 0))
+	  break;
+      if (node->min == node->max && i == node->min)
+	{
+	  lits_exact (out, &lit);
+	  break;
+	}
+      out->prefix = out->required = lit;
+      out->suffix.len = 0;
+      for (i = 0; i < node->min; i++)
+	if (lit_join (&out->suffix, &a.prefix, &out->suffix, 1))
+	  break;
+      break;
+    }
+}
+
+/* Test whether a is contained in b */
+static int
+lit_within (const struct lit *a, const struct lit *b)
+{
+  return memmem (b->s, b->len, a->s, a->len) != NULL;
+}
+
+static char *
+lit_dup (const struct lit *lit)
+{
+  char *s;
+
+  if (lit->len == 0 || (s = xmlMalloc (lit->len + 1)) == NULL)
+    return NULL;
+  memcpy (s, lit->s, lit->len);
+  s[lit->len] = '\0';
+  return s;
+}
+
+/****************************************************************************
+ * Interface
+ ****************************************************************************/
+
+static void
+parser_free (struct parser *ps)
+{
+  xmlSafeFree (ps->node);
+  xmlSafeFree (ps->cclass);
+  xmlSafeFree (ps->range);
+  ps->node = NULL;
+  ps->cclass = NULL;
+  ps->range = NULL;
+}
+
+/* Parse a pattern adding to the syntax tree and classes in ps.  On error
+   the parser's storage is released. */
+static int
+parse (struct parser *ps, const char *pattern)
+{
+  int root;
+
+  ps->p = (const unsigned char *) pattern;
+  ps->depth = 0;
+  root = parse_alt (ps);
+  if (!ps->error && *ps->p != '\0')
+    ps->error = REG_EPAREN;
+  if (ps->error)
+    parser_free (ps);
+  return root;
+}
+
+/* Compile the syntax trees of one or more patterns, each pattern's match
+   instruction records its index.  The parser's storage is consumed. */
+static int
+compile (nfa_t **preg, struct parser *ps, const int *roots, int nroots)
+{
+  nfa_t *nfa;
+  int ainst, error, split, i;
+
+  if ((nfa = xmlMalloc (sizeof (nfa_t))) == NULL)
+    {
+      parser_free (ps);
+      return REG_ESPACE;
+    }
+  memset (nfa, 0, sizeof (nfa_t));
+  nfa->cflags = ps->cflags;
+  nfa->nsub = nroots == 1 ? ps->ngroup : 0;
+  nfa->cclass = ps->cclass;
+  nfa->nclass = ps->nclass;
+  nfa->range = ps->range;
+
+  /* program is:  save 0; <pattern>; save 1; match
+     or for a set:  save 0; split L1, L2; L1: <pattern 0>; save 1; match 0;
+		    L2: split L3, L4; L3: <pattern 1> ... */
+  ainst = 0;
+  error = emit (nfa, &ainst, I_SAVE, 0, 0) < 0;
+  for (i = 0; !error && i < nroots; i++)
+    {
+      split = -1;
+      if (i < nroots - 1 && (split = emit (nfa, &ainst, I_SPLIT, 0, 0)) >= 0)
+	nfa->inst[split].x = nfa->ninst;
+      error = (i < nroots - 1 && split < 0)
+	      || emit_node (nfa, &ainst, ps->node, roots[i]) < 0
+	      || emit (nfa, &ainst, I_SAVE, 1, 0) < 0
+	      || emit (nfa, &ainst, I_MATCH, i, 0) < 0;
+      if (!error && split >= 0)
+	nfa->inst[split].y = nfa->ninst;
+    }
+  xmlSafeFree (ps->node);
+  if (error)
+    {
+      nfa_free (nfa);
+      return REG_ESPACE;
+    }
+
+  nfa->mark = xmlMalloc (nfa->ninst * sizeof (int));
+  nfa->stack = xmlMalloc ((3 * nfa->ninst + 2) * sizeof (struct job));
+  nfa->seed = xmlMalloc (2 * nfa->ninst * sizeof (int));
+  if (nfa->mark == NULL || nfa->stack == NULL || nfa->seed == NULL
+      || char_classes (nfa) < 0)
+    {
+      nfa_free (nfa);
+      return REG_ESPACE;
+    }
+  memset (nfa->mark, 0, nfa->ninst * sizeof (int));
+  *preg = nfa;
+  return 0;
+}
+
+int
+nfa_comp (nfa_t **preg, const char *pattern, int cflags)
+{
+  struct parser ps;
+  int root;
+
+  *preg = NULL;
+  memset (&ps, 0, sizeof ps);
+  ps.cflags = cflags;
+  root = parse (&ps, pattern);
+  if (ps.error)
+    return ps.error;
+  return compile (preg, &ps, &root, 1);
+}
+
+int
+nfa_comp_set (nfa_t **preg, const char *const patterns[], int npatterns,
+	      int cflags)
+{
+  struct parser ps;
+  int *roots, i, error;
+
+  *preg = NULL;
+  if (npatterns < 1)
+    return REG_BADPAT;
+  if ((roots = xmlMalloc (npatterns * sizeof (int))) == NULL)
+    return REG_ESPACE;
+  memset (&ps, 0, sizeof ps);
+  ps.cflags = cflags;
+  for (i = 0; i < npatterns; i++)
+    {
+      roots[i] = parse (&ps, patterns[i]);
+      if (ps.error)
+	{
+	  xmlFree (roots);
+	  return ps.error;
+	}
+    }
+  error = compile (preg, &ps, roots, npatterns);
+  xmlFree (roots);
+  return error;
+}
+
+int
+nfa_exec (nfa_t *nfa, const char *string, size_t nmatch,
+	  regmatch_t pmatch[], int eflags)
+{
+  if (nmatch == 0 || (nfa->cflags & REG_NOSUB))
+    return dfa_exec (nfa, (const unsigned char *) string, eflags);
+  return pike_exec (nfa, (const unsigned char *) string, nmatch, pmatch,
+		    eflags);
+}
+
+int
+nfa_exec_set (nfa_t *nfa, const char *string, int eflags)
+{
+  return dfa_exec_set (nfa, (const unsigned char *) string, eflags);
+}
+
+int
+nfa_literals (struct nfa_literals *lits, const char *pattern, int cflags)
+{
+  struct parser ps;
+  struct lits out;
+  int root;
+
+  memset (lits, 0, sizeof (struct nfa_literals));
+  /* the analysis recurses on groups, long patterns are rarely worth it */
+  if (strlen (pattern) > LIT_PATTERN_MAX)
+    return 0;
+  memset (&ps, 0, sizeof ps);
+  ps.cflags = cflags;
+  root = parse (&ps, pattern);
+  if (ps.error)
+    return ps.error;
+  analyse (ps.node, root, cflags, &out);
+  parser_free (&ps);
+
+  if (out.abegin)
+    lits->start = lit_dup (&out.prefix);
+  if (out.aend)
+    lits->end = lit_dup (&out.suffix);
+  /* skip the required string if it is already checked by the above */
+  if (!(lits->start != NULL && lit_within (&out.required, &out.prefix))
+      && !(lits->end != NULL && lit_within (&out.required, &out.suffix)))
+    lits->required = lit_dup (&out.required);
+  return 0;
+}
+
+void
+nfa_literals_free (struct nfa_literals *lits)
+{
+  xmlSafeFree (lits->start);
+  xmlSafeFree (lits->end);
+  xmlSafeFree (lits->required);
+  memset (lits, 0, sizeof (struct nfa_literals));
+}
+
+size_t
+nfa_nsub (const nfa_t *nfa)
+{
+  return nfa->nsub;
+}
+
+void
+nfa_free (nfa_t *nfa)
+{
+  int i;
+
+  if (nfa == NULL)
+    return;
+  dfa_flush (nfa);
+  for (i = 0; i < 2; i++)
+    {
+      xmlSafeFree (nfa->list[i].pc);
+      xmlSafeFree (nfa->list[i].caps);
+    }
+  xmlSafeFree (nfa->best);
+  xmlSafeFree (nfa->caps);
+  xmlSafeFree (nfa->mark);
+  xmlSafeFree (nfa->stack);
+  xmlSafeFree (nfa->seed);
+  xmlSafeFree (nfa->cclass);
+  xmlSafeFree (nfa->range);
+  xmlSafeFree (nfa->ustart);
+  xmlSafeFree (nfa->uclass);
+  xmlSafeFree (nfa->inst);
+  xmlFree (nfa);
+}
@@ -0,0 +1,44 @@
+#ifndef _xp_nfa_h
+#define _xp_nfa_h
+
+#include <sys/types.h>
+#include <regex.h>
+
+/* Linear time matcher for Posix extended regular expressions.  The
+   interface follows regcomp()/regexec() so that it may be used as a
+   drop in replacement. */
+
+typedef struct nfa nfa_t;
+
+/* Compilation flag, in addition to the REG_ flags, for UTF-8 patterns and
+   strings which are matched a character rather than a byte at a time */
+#define NFA_UTF8	0x0100
+
+int nfa_comp (nfa_t **preg, const char *pattern, int cflags);
+int nfa_exec (nfa_t *preg, const char *string,
+	      size_t nmatch, regmatch_t pmatch[], int eflags);
+size_t nfa_nsub (const nfa_t *preg);
+void nfa_free (nfa_t *preg);
+
+/* A set of patterns compiled together so that a string may be matched
+   against all of them in a single pass.  nfa_exec_set() returns the
+   index of the first pattern in the set which matches, -1 if none match
+   or -2 if memory is exhausted. */
+int nfa_comp_set (nfa_t **preg, const char *const patterns[], int npatterns,
+		  int cflags);
+int nfa_exec_set (nfa_t *preg, const char *string, int eflags);
+
+/* Literal strings which every match of a pattern must contain, so that
+   strings may be rejected cheaply before running a matcher.  Each string
+   is NULL when nothing is known, as for every string of a long pattern. */
+struct nfa_literals
+  {
+    char *start;		/* the string must start with this */
+    char *end;			/* the string must end with this */
+    char *required;		/* the string must contain this */
+  };
+
+int nfa_literals (struct nfa_literals *lits, const char *pattern, int cflags);
+void nfa_literals_free (struct nfa_literals *lits);
+
+#endif
@@ -4,21 +4,62 @@
 #include <libxml/xpathInternals.h>
 #include <libxml/parser.h>
 #include <libxml/encoding.h>
+#include <libxml/hash.h>
 
 #include <libxslt/xsltconfig.h>
 #include <libxslt/xsltutils.h>
 #include <libxslt/xsltInternals.h>
 #include <libxslt/extensions.h>
+#include <libxslt/variables.h>
 
 #include "xp-regexp.h"
+#include "xp-nfa.h"
+#include "stats.h"
 
 #include <sys/types.h>
 #include <regex.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 
+#if !defined (__GNUC__) || __GNUC__ < 2
+# define __attribute__(x)
+#endif
+#define _unused	__attribute__((unused))
+
 #define NMATCH		100
 
+/* Maximum number of compiled patterns retained per transformation */
+#define RE_CACHE_SIZE	64
+
+/* Maximum number of parsed replacement templates retained per pattern */
+#define RE_TEMPLATE_MAX	8
+
+/* Largest node content buffer retained between filter() calls */
+#define SCRATCH_MAX	65536
+
+/* filter() divides node-sets of at least RE_FILTER_THRESHOLD nodes between
+   RE_FILTER_THREADS threads, or one per online processor if zero.  One,
+   the default, tests every node in the calling thread. */
+#ifndef RE_FILTER_THREADS
+# define RE_FILTER_THREADS	1
+#endif
+#ifndef RE_FILTER_THRESHOLD
+# define RE_FILTER_THRESHOLD	10000
+#endif
+#define FILTER_MAX_THREADS	64
+
+/* Compilation flag selecting the linear time matcher, chosen not to
+   clash with the REG_ flags */
+#define RE_LINEAR	0x1000
+
+/* Marks the cache key of a pattern set so that it cannot collide with a
+   single pattern */
+#define RE_SET		0x2000
+
 /* Not clear if xmlFree() is safe for NULL pointers */
 static inline void
 xmlSafeFree (void *ptr)
@@ -28,6 +69,370 @@ xmlSafeFree (void *ptr)
 }
 
 /****************************************************************************
+ * Compiled pattern cache.
+ *
+ * Stylesheets tend to apply the same few patterns over and over, so each
+ * transformation keeps the most recently used compiled patterns keyed on
+ * the pattern and the compilation flags.  Entries are chained in most
+ * recently used order and the least recently used entry is discarded when
+ * the cache is full.
+ ****************************************************************************/
+
+struct template;
+
+struct re_entry
+  {
+    struct re_entry *prev, *next;	/* LRU chain, most recent first */
+    struct template *templates;		/* replacements, most recent first */
+    xmlChar *pattern;
+    xmlChar key[16];			/* cflags as a hash key */
+    int cflags;
+    size_t nsub;
+    nfa_t *nfa;				/* linear time matcher or ... */
+    regex_t re;				/* ... the C library */
+    struct nfa_literals lits;		/* literals for rejecting strings */
+    int start_len, end_len, required_len;
+  };
+
+struct re_cache
+  {
+    xmlHashTable *table;
+    struct re_entry *head, *tail;
+    int count;
+    unsigned long hits, misses, evictions;
+    xmlBuffer *scratch;			/* node content for filter() */
+    xmlDoc *rvt;			/* fragment for match() to reuse ... */
+    xmlNode *rvt_last;			/* ... and its last match element */
+  };
+
+static void template_free (struct template *tpl);
+
+static void
+re_entry_free (struct re_entry *entry)
+{
+  if (entry->templates != NULL)
+    template_free (entry->templates);
+  nfa_literals_free (&entry->lits);
+  if (entry->nfa != NULL)
+    nfa_free (entry->nfa);
+  else
+    regfree (&entry->re);
+  xmlFree (entry->pattern);
+  xmlFree (entry);
+}
+
+static void
+re_unlink (struct re_cache *cache, struct re_entry *entry)
+{
+  if (entry->prev != NULL)
+    entry->prev->next = entry->next;
+  else
+    cache->head = entry->next;
+  if (entry->next != NULL)
+    entry->next->prev = entry->prev;
+  else
+    cache->tail = entry->prev;
+  entry->prev = entry->next = NULL;
+}
+
+static void
+re_push (struct re_cache *cache, struct re_entry *entry)
+{
+  entry->prev = NULL;
+  entry->next = cache->head;
+  if (cache->head != NULL)
+    cache->head->prev = entry;
+  else
+    cache->tail = entry;
+  cache->head = entry;
+}
+
+/* Find a cached entry, making it the most recently used */
+static struct re_entry *
+re_lookup (struct re_cache *cache, const xmlChar *pattern, const xmlChar *key)
+{
+  struct re_entry *entry;
+
+  if (cache == NULL
+      || (entry = xmlHashLookup2 (cache->table, pattern, key)) == NULL)
+    return NULL;
+  cache->hits++;
+  if (entry != cache->head)
+    {
+      re_unlink (cache, entry);
+      re_push (cache, entry);
+    }
+  return entry;
+}
+
+/* Add a newly compiled entry to the cache, discarding the least recently
+   used entry if the cache is full */
+static struct re_entry *
+re_insert (struct re_cache *cache, struct re_entry *entry)
+{
+  if (cache == NULL)
+    return entry;
+
+  cache->misses++;
+  if (cache->count >= RE_CACHE_SIZE)
+    {
+      struct re_entry *lru = cache->tail;
+
+      re_unlink (cache, lru);
+      xmlHashRemoveEntry2 (cache->table, lru->pattern, lru->key, NULL);
+      re_entry_free (lru);
+      cache->count--;
+      cache->evictions++;
+    }
+  if (xmlHashAddEntry2 (cache->table, entry->pattern, entry->key, entry) != 0)
+    {
+      re_entry_free (entry);
+      return NULL;
+    }
+  re_push (cache, entry);
+  cache->count++;
+  return entry;
+}
+
+/* Return the compiled pattern, compiling it if not already cached.
+   If cache is NULL the entry must be released with re_release(). */
+static struct re_entry *
+re_compile (struct re_cache *cache, const xmlChar *pattern, int cflags)
+{
+  struct re_entry *entry;
+  xmlChar key[sizeof entry->key];
+
+  snprintf ((char *) key, sizeof key, "%x", cflags);
+  if ((entry = re_lookup (cache, pattern, key)) != NULL)
+    return entry;
+
+  if ((entry = xmlMalloc (sizeof (struct re_entry))) == NULL)
+    return NULL;
+  memset (entry, 0, sizeof (struct re_entry));
+  if (cflags & RE_LINEAR)
+    {
+      if (nfa_comp (&entry->nfa, (const char *) pattern,
+		    cflags & ~RE_LINEAR) != 0)
+	{
+	  xmlFree (entry);
+	  return NULL;
+	}
+      entry->nsub = nfa_nsub (entry->nfa);
+    }
+  else
+    {
+      if (regcomp (&entry->re, (const char *) pattern, cflags) != 0)
+	{
+	  xmlFree (entry);
+	  return NULL;
+	}
+      entry->nsub = entry->re.re_nsub;
+    }
+  /* literals are not found if the pattern is not understood */
+  nfa_literals (&entry->lits, (const char *) pattern, cflags & ~RE_LINEAR);
+  entry->start_len = xmlStrlen (cX entry->lits.start);
+  entry->end_len = xmlStrlen (cX entry->lits.end);
+  entry->required_len = xmlStrlen (cX entry->lits.required);
+  entry->pattern = xmlStrdup (pattern);
+  memcpy (entry->key, key, sizeof key);
+  entry->cflags = cflags;
+  return re_insert (cache, entry);
+}
+
+/* As re_compile() for a set of patterns combined into a single linear
+   time matcher.  The set is cached under its patterns each prefixed by
+   its length, which cannot be confused with a different set. */
+static struct re_entry *
+re_compile_set (struct re_cache *cache, xmlChar **patterns, int npatterns,
+		int cflags)
+{
+  struct re_entry *entry;
+  xmlChar key[sizeof entry->key];
+  xmlBuffer *buf;
+  char len[16];
+  int i;
+
+  if ((buf = xmlBufferCreate ()) == NULL)
+    return NULL;
+  for (i = 0; i < npatterns; i++)
+    {
+      snprintf (len, sizeof len, "%d:", xmlStrlen (patterns[i]));
+      xmlBufferCCat (buf, len);
+      xmlBufferCat (buf, patterns[i]);
+    }
+  cflags = (cflags & ~RE_LINEAR) | RE_SET;
+  snprintf ((char *) key, sizeof key, "%x", cflags);
+  if ((entry = re_lookup (cache, xmlBufferContent (buf), key)) != NULL)
+    {
+      xmlBufferFree (buf);
+      return entry;
+    }
+
+  if ((entry = xmlMalloc (sizeof (struct re_entry))) == NULL)
+    {
+      xmlBufferFree (buf);
+      return NULL;
+    }
+  memset (entry, 0, sizeof (struct re_entry));
+  if (nfa_comp_set (&entry->nfa, (const char *const *) patterns, npatterns,
+		    cflags & ~RE_SET) != 0)
+    {
+      xmlBufferFree (buf);
+      xmlFree (entry);
+      return NULL;
+    }
+  entry->pattern = xmlBufferDetach (buf);
+  xmlBufferFree (buf);
+  memcpy (entry->key, key, sizeof key);
+  entry->cflags = cflags;
+  return re_insert (cache, entry);
+}
+
+/* Return zero if the string lacks a literal that every match of the
+   pattern contains.  len is -1 if not known. */
+static int
+re_prefilter (const struct re_entry *entry, const xmlChar *string, int len)
+{
+  if (len < 0)
+    len = xmlStrlen (string);
+  if (entry->start_len > 0
+      && (len < entry->start_len
+	  || memcmp (string, entry->lits.start, entry->start_len) != 0))
+    return 0;
+  if (entry->end_len > 0
+      && (len < entry->end_len
+	  || memcmp (string + len - entry->end_len, entry->lits.end,
+		     entry->end_len) != 0))
+    return 0;
+  if (entry->required_len == 1)
+    return memchr (string, entry->lits.required[0], len) != NULL;
+  if (entry->required_len > 1)
+    return memmem (string, len, entry->lits.required,
+		   entry->required_len) != NULL;
+  return 1;
+}
+
+static int
+re_exec (struct re_entry *entry, const xmlChar *string, int len,
+	 size_t nmatch, regmatch_t pmatch[], int eflags)
+{
+  /* the literals only apply when matching from the start of the string */
+  if (eflags == 0
+      && (entry->start_len | entry->end_len | entry->required_len) != 0
+      && !re_prefilter (entry, string, len))
+    return REG_NOMATCH;
+  if (entry->nfa != NULL)
+    return nfa_exec (entry->nfa, (const char *) string, nmatch, pmatch, eflags);
+  /* when the length is known, tell regexec() where the string ends so
+     that it does not rescan the remainder of the string on each call */
+  if (len >= 0 && nmatch > 0)
+    {
+      pmatch[0].rm_so = 0;
+      pmatch[0].rm_eo = len;
+      eflags |= REG_STARTEND;
+    }
+  return regexec (&entry->re, (const char *) string, nmatch, pmatch, eflags);
+}
+
+static void
+re_release (struct re_cache *cache, struct re_entry *entry)
+{
+  if (cache == NULL && entry != NULL)
+    re_entry_free (entry);
+}
+
+static struct re_cache *
+re_get_cache (xmlXPathParserContextPtr ctxt)
+{
+  xsltTransformContext *tctxt;
+
+  tctxt = xsltXPathGetTransformContext (ctxt);
+  if (tctxt == NULL)
+    return NULL;
+  return xsltGetExtData (tctxt, XSLT_REGEXP_NAMESPACE);
+}
+
+static void *
+re_ctxt_init (xsltTransformContext *tctxt _unused,
+	      const xmlChar *uri _unused)
+{
+  struct re_cache *cache;
+
+  if ((cache = xmlMalloc (sizeof (struct re_cache))) == NULL)
+    return NULL;
+  memset (cache, 0, sizeof (struct re_cache));
+  if ((cache->table = xmlHashCreate (RE_CACHE_SIZE)) == NULL)
+    {
+      xmlFree (cache);
+      return NULL;
+    }
+  return cache;
+}
+
+static void
+re_ctxt_shutdown (xsltTransformContext *tctxt _unused,
+		  const xmlChar *uri _unused, void *data)
+{
+  struct re_cache *cache = data;
+  struct re_entry *entry, *next;
+
+  if (cache == NULL)
+    return;
+#ifdef WITH_XSLT_DEBUG_REGEXP
+  xsltGenericDebug (xsltGenericDebugContext,
+		    "regexp cache: %lu hits, %lu misses, %lu evictions\n",
+		    cache->hits, cache->misses, cache->evictions);
+#endif
+  if (cache->scratch != NULL)
+    xmlBufferFree (cache->scratch);
+  xmlHashFree (cache->table, NULL);
+  for (entry = cache->head; entry != NULL; entry = next)
+    {
+      next = entry->next;
+      re_entry_free (entry);
+    }
+  xmlFree (cache);
+}
+
+/* Parse the flags argument common to all the functions */
+static int
+parse_flags (const xmlChar *flags, int *global, int *reuse)
+{
+  const xmlChar *p;
+  int re_flags;
+
+  re_flags = REG_EXTENDED;
+  for (p = flags; *p != '\0'; p++)
+    switch (*p)
+      {
+      case 'g':
+	if (global != NULL)
+	  *global = 1;
+	break;
+      case 'i':
+	re_flags |= REG_ICASE;
+	break;
+      case 'm':
+	re_flags |= REG_NEWLINE;
+	break;
+      case 'l':
+	re_flags |= RE_LINEAR;
+	break;
+      case 'u':
+	/* only the linear time matcher understands UTF-8 */
+	re_flags |= RE_LINEAR | NFA_UTF8;
+	break;
+      case 'r':
+	if (reuse != NULL)
+	  *reuse = 1;
+	break;
+      }
+  return re_flags;
+}
+
+/****************************************************************************
+ * Replacement templates.
+ *
  * Within the replacement strings, the following are recognised:
  * \\ - stands for a \ sign
  * &  - the matched substring (N.B. write as &amp; in XML documents)
@@ -35,64 +440,109 @@ xmlSafeFree (void *ptr)
  * \p - the portion of the string that precedes the matched substring (prefix)
  * \s - the portion of the string that follows the matched substring (suffix)
  * \nnn - the nth matched substring
+ *
+ * The replacement string is parsed once into a list of literal text and
+ * substring references which is then expanded for each match.  Since the
+ * parse depends on the number of subexpressions, parsed templates are kept
+ * with the compiled pattern so that repeated calls using the same pattern
+ * and replacement need not parse the replacement again.
  ****************************************************************************/
-static xmlChar *
-copy_match (xmlChar *result, const xmlChar *string,
-	    const xmlChar *replacement, const xmlChar *tail,
-	    regmatch_t *match, size_t nsub)
-{
-  size_t nth;
-  int sub_len;
-  const xmlChar *rep, *sub;
+
+enum
+  {
+    T_TEXT, T_GROUP, T_PREFIX, T_SUFFIX,
+  };
+
+struct top
+  {
+    int op;
+    int len;			/* length of text or group number */
+    const xmlChar *text;
+  };
+
+struct template
+  {
+    struct template *next;
+    xmlChar *replacement;	/* private copy, text in ops refers to it */
+    int nops;
+    struct top ops[];
+  };
+
+static void
+template_free (struct template *tpl)
+{
+  struct template *next;
+
+  for (; tpl != NULL; tpl = next)
+    {
+      next = tpl->next;
+      xmlFree (tpl);
+    }
+}
+
+static void
+template_add (struct template *tpl, int op, int len, const xmlChar *text)
+{
+  struct top *top = &tpl->ops[tpl->nops++];
+
+  top->op = op;
+  top->len = len;
+  top->text = text;
+}
+
+/* Parse the replacement string.  The template holds a copy of the
+   replacement string, allocated along with the template itself. */
+static struct template *
+template_parse (const xmlChar *replacement, size_t nsub)
+{
+  struct template *tpl;
+  const xmlChar *rep;
+  unsigned long nth;
   char *es;
+  int n, len;
+
+  /* each special sequence generates at most two entries */
+  for (n = 1, rep = replacement;
+       (rep = cX strpbrk ((const char *) rep, "&\\")) != NULL; rep++)
+    n += 2;
+  len = xmlStrlen (replacement);
+  tpl = xmlMalloc (sizeof (struct template) + n * sizeof (struct top)
+		   + len + 1);
+  if (tpl == NULL)
+    return NULL;
+  tpl->next = NULL;
+  tpl->nops = 0;
+  tpl->replacement = (xmlChar *) &tpl->ops[n];
+  memcpy (tpl->replacement, replacement, len + 1);
+  replacement = tpl->replacement;
 
   while ((rep = cX strpbrk ((const char *) replacement, "&\\")) != NULL)
     {
       /* Copy the leading portion of the substitution.  */
       if (rep > replacement)
-	result = xmlStrncat (result, replacement, rep - replacement);
-      /* Copy the replacement string */
-      sub = NULL;
-      sub_len = 0;
+	template_add (tpl, T_TEXT, rep - replacement, replacement);
       if (*rep == '&')
 	{
-	  if (match[0].rm_so != -1)
-	    {
-	      sub = tail + match[0].rm_so;
-	      sub_len = match[0].rm_eo - match[0].rm_so;
-	    }
+	  template_add (tpl, T_GROUP, 0, NULL);
 	  replacement = rep + 1;
 	}
       else
 	switch (*++rep)
 	  {
 	  case '\\':
-	    sub = rep;
-	    sub_len = 1;
+	    template_add (tpl, T_TEXT, 1, rep);
 	    replacement = rep + 1;
 	    break;
 	  case '0':
-	    if (match[0].rm_so != -1)
-	      {
-		sub = tail + match[0].rm_so;
-		sub_len = match[0].rm_eo - match[0].rm_so;
-	      }
+	    template_add (tpl, T_GROUP, 0, NULL);
 	    replacement = rep + 1;
 	    break;
 	  case 'p':
-	    if (match[0].rm_so != -1)
-	      {
-		sub = string;
-		sub_len = tail - string + match[0].rm_so;
-	      }
+	    template_add (tpl, T_PREFIX, 0, NULL);
 	    replacement = rep + 1;
 	    break;
 	  case 's':
-	    if (match[0].rm_so != -1)
-	      {
-		sub = tail + match[0].rm_eo;
-		sub_len = xmlStrlen (sub);
-	      }
+	    template_add (tpl, T_SUFFIX, 0, NULL);
 	    replacement = rep + 1;
 	    break;
 	  default:
@@ -100,27 +550,93 @@ copy_match (xmlChar *result, const xmlChar *string,
 		&& (nth = strtoul ((const char *) rep, &es, 10)) >= 1
 		&& nth <= nsub)
 	      {
-		if (match[nth].rm_so != -1)
-		  {
-		    sub = tail + match[nth].rm_so;
-		    sub_len = match[nth].rm_eo - match[nth].rm_so;
-		  }
+		template_add (tpl, T_GROUP, nth, NULL);
 		replacement = (xmlChar *) es;
 	      }
 	    else
 	      {
-		sub = cX "\\";
-		sub_len = 1;
+		template_add (tpl, T_TEXT, 1, cX "\\");
 		replacement = rep;
 	      }
 	    break;
 	  }
-      if (sub_len > 0)
-	result = xmlStrncat (result, sub, sub_len);
     }
-  return xmlStrcat (result, replacement);
+  if (*replacement != '\0')
+    template_add (tpl, T_TEXT, xmlStrlen (replacement), replacement);
+  return tpl;
+}
+
+/* Return the parsed template for the replacement string, parsing it if
+   it is not already held by the compiled pattern. */
+static struct template *
+template_lookup (struct re_entry *entry, const xmlChar *replacement)
+{
+  struct template *tpl, **prev;
+  int n;
+
+  for (n = 0, prev = &entry->templates; (tpl = *prev) != NULL;
+       n++, prev = &tpl->next)
+    if (xmlStrEqual (tpl->replacement, replacement))
+      {
+	/* move to the front of the list */
+	*prev = tpl->next;
+	tpl->next = entry->templates;
+	entry->templates = tpl;
+	return tpl;
+      }
+
+  if ((tpl = template_parse (replacement, entry->nsub)) == NULL)
+    return NULL;
+
+  /* discard the least recently used template when the list is full */
+  if (n >= RE_TEMPLATE_MAX)
+    {
+      for (prev = &entry->templates; (*prev)->next != NULL;
+	   prev = &(*prev)->next)
+	;
+      template_free (*prev);
+      *prev = NULL;
+    }
+  tpl->next = entry->templates;
+  entry->templates = tpl;
+  return tpl;
 }
 
+/* Append the replacement for the match at tail to the buffer.  string
+   is the complete string of length len. */
+static void
+template_expand (const struct template *tpl, xmlBuffer *buf,
+		 const xmlChar *string, int len, const xmlChar *tail,
+		 const regmatch_t *match)
+{
+  const struct top *top;
+  int i;
+
+  for (i = 0; i < tpl->nops; i++)
+    {
+      top = &tpl->ops[i];
+      switch (top->op)
+	{
+	case T_TEXT:
+	  xmlBufferAdd (buf, top->text, top->len);
+	  break;
+	case T_GROUP:
+	  if (match[top->len].rm_so != -1)
+	    xmlBufferAdd (buf, tail + match[top->len].rm_so,
+			  match[top->len].rm_eo - match[top->len].rm_so);
+	  break;
+	case T_PREFIX:
+	  if (match[0].rm_so != -1)
+	    xmlBufferAdd (buf, string, tail - string + match[0].rm_so);
+	  break;
+	case T_SUFFIX:
+	  if (match[0].rm_so != -1)
+	    xmlBufferAdd (buf, tail + match[0].rm_eo,
+			  len - (tail - string) - match[0].rm_eo);
+	  break;
+	}
+    }
+}
 
 /****************************************************************************
  * pre_replace:
@@ -132,9 +648,11 @@ static void
 pre_replace (xmlXPathParserContextPtr ctxt, int nargs)
 {
   xmlChar *string, *tail, *pattern, *flags, *replacement, *ret = NULL;
-  xmlChar *p;
-  int global, re_flags;
-  regex_t re;
+  int global, re_flags, eflags, len, n;
+  struct re_cache *cache;
+  struct re_entry *entry;
+  struct template *tpl;
+  xmlBuffer *buf;
   regmatch_t match[NMATCH];
 
   if (nargs != 4)
@@ -179,37 +697,46 @@ pre_replace (xmlXPathParserContextPtr ctxt, int nargs)
 
   /* parse substitution flags */
   global = 0;
-  re_flags = REG_EXTENDED;
-  for (p = flags; *p != '\0'; p++)
-    switch (*p)
-      {
-      case 'g':
-        global = 1;
-	break;
-      case 'i':
-        re_flags |= REG_ICASE;
-	break;
-      case 'm':
-        re_flags |= REG_NEWLINE;
-	break;
-      }
+  re_flags = parse_flags (flags, &global, NULL);
 
-  if (regcomp (&re, (char *) pattern, re_flags) == 0)
+  cache = re_get_cache (ctxt);
+  if ((entry = re_compile (cache, pattern, re_flags)) != NULL)
     {
-      tail = string;
-      if (regexec (&re, (char *) tail, NMATCH, match, 0) == 0)
-	do
-	  {
-	    if (match[0].rm_so > 0)
-	      ret = xmlStrncat (ret, tail, match[0].rm_so);
-	    if (replacement != NULL)
-	      ret = copy_match (ret, string, replacement, tail,
-				match, re.re_nsub);
-	    tail += match[0].rm_eo;
-	  }
-	while (global && regexec (&re, (char *) tail, NMATCH, match, REG_NOTBOL) == 0);
-      ret = xmlStrcat (ret, tail);
-      regfree (&re);
+      /* build the result in a single buffer which grows geometrically */
+      len = xmlStrlen (string);
+      tpl = template_lookup (entry, replacement);
+      buf = xmlBufferCreateSize (len + 1);
+      if (tpl != NULL && buf != NULL)
+	{
+	  xmlBufferSetAllocationScheme (buf, XML_BUFFER_ALLOC_DOUBLEIT);
+	  tail = string;
+	  eflags = 0;
+	  while (re_exec (entry, tail, len - (tail - string),
+			  NMATCH, match, eflags) == 0)
+	    {
+	      xmlBufferAdd (buf, tail, match[0].rm_so);
+	      template_expand (tpl, buf, string, len, tail, match);
+	      tail += match[0].rm_eo;
+	      if (!global)
+		break;
+	      /* step over the next character after an empty match */
+	      if (match[0].rm_so == match[0].rm_eo)
+		{
+		  if (*tail == '\0')
+		    break;
+		  if ((n = xmlUTF8Size (tail)) < 1)
+		    n = 1;
+		  xmlBufferAdd (buf, tail, n);
+		  tail += n;
+		}
+	      eflags = REG_NOTBOL;
+	    }
+	  xmlBufferAdd (buf, tail, -1);
+	  ret = xmlBufferDetach (buf);
+	}
+      if (buf != NULL)
+	xmlBufferFree (buf);
+      re_release (cache, entry);
     }
 
   xmlSafeFree (string);
@@ -220,6 +747,93 @@ pre_replace (xmlXPathParserContextPtr ctxt, int nargs)
   xmlXPathReturnString (ctxt, ret);
 }
 
+/* Advance past a match when searching globally.  After an empty match the
+   next character is skipped so that the search makes progress.  Returns
+   NULL when the end of the string is reached. */
+static const xmlChar *
+re_advance (const xmlChar *tail, const regmatch_t *match)
+{
+  int n;
+
+  tail += match[0].rm_eo;
+  if (match[0].rm_so == match[0].rm_eo)
+    {
+      if (*tail == '\0')
+	return NULL;
+      if ((n = xmlUTF8Size (tail)) < 1)
+	n = 1;
+      tail += n;
+    }
+  return tail;
+}
+
+/* Count the leading submatches, up to the last one which participated */
+static int
+count_submatches (const regmatch_t *match, int nmatch)
+{
+  for (; nmatch > 0; nmatch--)
+    if (match[nmatch - 1].rm_so != -1)
+      break;
+  return nmatch;
+}
+
+static int
+rvt_listed (xmlDoc *list, xmlDoc *rvt)
+{
+  for (; list != NULL; list = (xmlDoc *) list->next)
+    if (list == rvt)
+      return 1;
+  return 0;
+}
+
+/* Return a result tree fragment to hold match elements.  If reuse is set,
+   the fragment from the previous call is returned provided it is still
+   held as a temporary fragment, that is the template instantiation which
+   created it has not yet completed, or is held by the variable whose value
+   is being evaluated.  New elements are only ever appended so that node
+   sets returned by earlier calls remain valid. */
+static xmlDoc *
+match_container (xsltTransformContext *tctxt, struct re_cache *cache,
+		 int reuse)
+{
+  xsltStackElem *var;
+  xmlDoc *container;
+
+  if (reuse && cache != NULL && (container = cache->rvt) != NULL)
+    {
+      /* check the fragment has not been released and recycled */
+      var = tctxt->contextVariable;
+      if ((rvt_listed (tctxt->tmpRVT, container)
+	   || rvt_listed (tctxt->localRVT, container)
+	   || (var != NULL && rvt_listed (var->fragment, container)))
+	  && container->psvi == XSLT_RVT_LOCAL
+	  && container->last == cache->rvt_last)
+	return container;
+      cache->rvt = NULL;
+    }
+
+  container = xsltCreateRVT (tctxt);
+  if (container == NULL)
+    return NULL;
+  xsltRegisterTmpRVT (tctxt, container);
+  return container;
+}
+
+/* Append a match element containing the text to the fragment */
+static xmlNode *
+match_element (xmlDoc *container, const xmlChar *text, int len)
+{
+  xmlNode *node;
+
+  node = xmlNewDocRawNode (container, NULL, cX "match", NULL);
+  if (node == NULL)
+    return NULL;
+  xmlAddChild ((xmlNode *) container, node);
+  if (text != NULL)
+    xmlAddChild (node, xmlNewDocTextLen (container, text, len));
+  return node;
+}
+
 /****************************************************************************
  * pre_match:
  *
@@ -229,14 +843,15 @@ pre_replace (xmlXPathParserContextPtr ctxt, int nargs)
 static void
 pre_match (xmlXPathParserContextPtr ctxt, int nargs)
 {
-  xmlNodePtr node, text;
+  xmlNodePtr node;
   xmlXPathObjectPtr ret;
-  xmlChar *string, *tail, *pattern, *flags;
-  xmlChar *p;
+  xmlChar *string, *pattern, *flags;
+  const xmlChar *tail;
   xmlDoc *container;
   xsltTransformContext *tctxt;
-  int global, re_flags, matches, i;
-  regex_t re;
+  int global, reuse, re_flags, eflags, len, matches, i;
+  struct re_cache *cache;
+  struct re_entry *entry;
   regmatch_t match[NMATCH];
 
   if (nargs < 2 || nargs > 3)
@@ -245,23 +860,11 @@ pre_match (xmlXPathParserContextPtr ctxt, int nargs)
       return;
     }
 
-  global = 0;
+  global = reuse = 0;
   re_flags = REG_EXTENDED;
   if (nargs == 3 && (flags = xmlXPathPopString (ctxt)) != NULL)
     {
-      for (p = flags; *p != '\0'; p++)
-	switch (*p)
-	  {
-	  case 'g':
-	    global = 1;
-	    break;
-	  case 'i':
-	    re_flags |= REG_ICASE;
-	    break;
-	  case 'm':
-	    re_flags |= REG_NEWLINE;
-	    break;
-	  }
+      re_flags = parse_flags (flags, &global, &reuse);
       xmlSafeFree (flags);
     }
 
@@ -281,14 +884,14 @@ pre_match (xmlXPathParserContextPtr ctxt, int nargs)
     }
 
   tctxt = xsltXPathGetTransformContext (ctxt);
-  container = xsltCreateRVT (tctxt);
+  cache = re_get_cache (ctxt);
+  container = match_container (tctxt, cache, reuse);
   if (container == NULL)
     {
       xmlSafeFree (string);
       xmlSafeFree (pattern);
       return;
     }
-  xsltRegisterTmpRVT (tctxt, container);
 
   ret = xmlXPathNewNodeSet (NULL);
   if (ret == NULL)
@@ -299,51 +902,50 @@ pre_match (xmlXPathParserContextPtr ctxt, int nargs)
     }
 
   ret->boolval = 0;
-  if (regcomp (&re, (char *) pattern, re_flags) == 0)
+  if ((entry = re_compile (cache, pattern, re_flags)) != NULL)
     {
+      len = xmlStrlen (string);
       tail = string;
-      if (regexec (&re, (char *) tail, NMATCH, match, 0) == 0)
+      if (global)
 	{
-	  if (global)
-	    do
-	      {
-		/* create a match element for each submatch */
-		node = xmlNewDocRawNode (container, NULL, cX "match", NULL);
-		xmlAddChild ((xmlNodePtr) container, node);
-		if (match[0].rm_so != -1)
-		  {
-		    text = xmlNewDocTextLen (container,
-					     tail + match[0].rm_so,
-					     match[0].rm_eo - match[0].rm_so);
-		    xmlAddChild (node, text);
-		  }
-		xmlXPathNodeSetAdd (ret->nodesetval, node);
-		tail += match[0].rm_eo;
-	      }
-	    while (regexec (&re, (char *) tail, NMATCH, match, REG_NOTBOL) == 0);
-	  else
+	  /* create a match element for each match */
+	  eflags = 0;
+	  while (tail != NULL
+		 && re_exec (entry, tail, len - (tail - string),
+			     1, match, eflags) == 0)
 	    {
-	      /* count the matches */
-	      for (matches = NMATCH; matches > 0; matches--)
-		if (match[matches - 1].rm_so != -1)
-		  break;
-	      /* create a match element for each submatch */
-	      for (i = 0; i < matches; i++)
-		{
-		  node = xmlNewDocRawNode (container, NULL, cX "match", NULL);
-		  xmlAddChild ((xmlNodePtr) container, node);
-		  if (match[i].rm_so != -1)
-		    {
-		      text = xmlNewDocTextLen (container,
-					       tail + match[i].rm_so,
-					       match[i].rm_eo - match[i].rm_so);
-		      xmlAddChild (node, text);
-		    }
-		  xmlXPathNodeSetAdd (ret->nodesetval, node);
-		}
+	      node = match_element (container, tail + match[0].rm_so,
+				    match[0].rm_eo - match[0].rm_so);
+	      /* new nodes need not be checked for duplicates */
+	      if (node != NULL)
+		xmlXPathNodeSetAddUnique (ret->nodesetval, node);
+	      tail = re_advance (tail, match);
+	      eflags = REG_NOTBOL;
+	    }
+	}
+      else if (re_exec (entry, tail, len, NMATCH, match, 0) == 0)
+	{
+	  /* create a match element for each submatch */
+	  matches = count_submatches (match, NMATCH);
+	  for (i = 0; i < matches; i++)
+	    {
+	      if (match[i].rm_so != -1)
+		node = match_element (container, tail + match[i].rm_so,
+				      match[i].rm_eo - match[i].rm_so);
+	      else
+		node = match_element (container, NULL, 0);
+	      if (node != NULL)
+		xmlXPathNodeSetAddUnique (ret->nodesetval, node);
 	    }
 	}
-      regfree (&re);
+      re_release (cache, entry);
+    }
+
+  /* remember the fragment if it can be reused */
+  if (reuse && cache != NULL && container->last != NULL)
+    {
+      cache->rvt = container;
+      cache->rvt_last = container->last;
     }
 
   valuePush (ctxt, ret);
@@ -352,19 +954,21 @@ pre_match (xmlXPathParserContextPtr ctxt, int nargs)
   xmlSafeFree (pattern);
 }
 
-
 /****************************************************************************
- * pre_test:
+ * pre_match_count:
  *
- * Returns TRUE if the  RE matches the string.
+ * Returns the number of match elements that match() would return, without
+ * creating them.
  ****************************************************************************/
 static void
-pre_test (xmlXPathParserContextPtr ctxt, int nargs)
+pre_match_count (xmlXPathParserContextPtr ctxt, int nargs)
 {
   xmlChar *string, *pattern, *flags;
-  xmlChar *p;
-  int match, re_flags;
-  regex_t re;
+  const xmlChar *tail;
+  int global, re_flags, eflags, len, count;
+  struct re_cache *cache;
+  struct re_entry *entry;
+  regmatch_t match[NMATCH];
 
   if (nargs < 2 || nargs > 3)
     {
@@ -372,19 +976,11 @@ pre_test (xmlXPathParserContextPtr ctxt, int nargs)
       return;
     }
 
+  global = 0;
   re_flags = REG_EXTENDED;
   if (nargs == 3 && (flags = xmlXPathPopString (ctxt)) != NULL)
     {
-      for (p = flags; *p != '\0'; p++)
-	switch (*p)
-	  {
-	  case 'i':
-	    re_flags |= REG_ICASE;
-	    break;
-	  case 'm':
-	    re_flags |= REG_NEWLINE;
-	    break;
-	  }
+      re_flags = parse_flags (flags, &global, NULL);
       xmlSafeFree (flags);
     }
 
@@ -403,34 +999,137 @@ pre_test (xmlXPathParserContextPtr ctxt, int nargs)
       return;
     }
 
-  match = 0;
-  if (regcomp (&re, (char *) pattern, re_flags) == 0)
+  count = 0;
+  cache = re_get_cache (ctxt);
+  if ((entry = re_compile (cache, pattern, re_flags)) != NULL)
     {
-      match = regexec (&re, (char *) string, 0, NULL, 0) == 0;
-      regfree (&re);
+      len = xmlStrlen (string);
+      tail = string;
+      if (global)
+	{
+	  eflags = 0;
+	  while (tail != NULL
+		 && re_exec (entry, tail, len - (tail - string),
+			     1, match, eflags) == 0)
+	    {
+	      count++;
+	      tail = re_advance (tail, match);
+	      eflags = REG_NOTBOL;
+	    }
+	}
+      else if (re_exec (entry, tail, len, NMATCH, match, 0) == 0)
+	count = count_submatches (match, NMATCH);
+      re_release (cache, entry);
     }
-  xmlXPathReturnBoolean (ctxt, match);
+  xmlXPathReturnNumber (ctxt, count);
 
   xmlSafeFree (string);
   xmlSafeFree (pattern);
 }
 
 /****************************************************************************
- * pre_filter:
+ * pre_group:
  *
- * Filter the node-set specified by the first argument.  For each
- * node cast to a string and if it matches the RE add it to the result
- * node-set.  Remaining arguments are as per test().
+ * Returns the portion of the string captured by the nth subexpression of
+ * the first match, or the entire match if n is zero.
  ****************************************************************************/
 static void
-pre_filter (xmlXPathParserContextPtr ctxt, int nargs)
+pre_group (xmlXPathParserContextPtr ctxt, int nargs)
 {
+  xmlChar *string, *pattern, *flags, *ret = NULL;
+  double number;
+  int re_flags, n;
+  struct re_cache *cache;
+  struct re_entry *entry;
+  regmatch_t match[NMATCH];
+
+  if (nargs < 3 || nargs > 4)
+    {
+      xmlXPathSetArityError (ctxt);
+      return;
+    }
+
+  re_flags = REG_EXTENDED;
+  if (nargs == 4 && (flags = xmlXPathPopString (ctxt)) != NULL)
+    {
+      re_flags = parse_flags (flags, NULL, NULL);
+      xmlSafeFree (flags);
+    }
+
+  number = xmlXPathPopNumber (ctxt);
+  if (xmlXPathCheckError (ctxt))
+    return;
+
+  pattern = xmlXPathPopString (ctxt);
+  if (xmlXPathCheckError (ctxt) || pattern == NULL)
+    {
+      xmlSafeFree (pattern);
+      return;
+    }
+
+  string = xmlXPathPopString (ctxt);
+  if (xmlXPathCheckError (ctxt) || string == NULL)
+    {
+      xmlSafeFree (string);
+      xmlSafeFree (pattern);
+      return;
+    }
+
+  cache = re_get_cache (ctxt);
+  if (number >= 0 && number < NMATCH
+      && (entry = re_compile (cache, pattern, re_flags)) != NULL)
+    {
+      n = (int) number;
+      if ((size_t) n <= entry->nsub
+	  && re_exec (entry, string, -1, n + 1, match, 0) == 0
+	  && match[n].rm_so != -1)
+	ret = xmlStrndup (string + match[n].rm_so,
+			  match[n].rm_eo - match[n].rm_so);
+      re_release (cache, entry);
+    }
+  if (ret == NULL)
+    ret = xmlStrdup (cX "");
+  xmlXPathReturnString (ctxt, ret);
+
+  xmlSafeFree (string);
+  xmlSafeFree (pattern);
+}
+
+/****************************************************************************
+ * pre_tokenize:
+ *
+ * Splits a string at each RE match and returns a node set of token
+ * elements, each containing the portion of the string between matches.
+ ****************************************************************************/
+
+/* Append a token element to the fragment */
+static xmlNode *
+token_element (xmlDoc *container, const xmlChar *text, int len)
+{
+  xmlNode *node, *child;
+
+  node = xmlNewDocRawNode (container, NULL, cX "token", NULL);
+  if (node == NULL)
+    return NULL;
+  xmlAddChild ((xmlNode *) container, node);
+  if (len > 0 && (child = xmlNewDocTextLen (container, text, len)) != NULL)
+    xmlAddChild (node, child);
+  return node;
+}
+
+static void
+pre_tokenize (xmlXPathParserContextPtr ctxt, int nargs)
+{
+  xmlNodePtr node;
+  xmlXPathObjectPtr ret;
   xmlChar *string, *pattern, *flags;
-  xmlChar *p;
-  xmlXPathObject *set, *obj;
-  xmlNode *node;
-  int re_flags, i;
-  regex_t re;
+  const xmlChar *tail, *start;
+  xmlDoc *container;
+  xsltTransformContext *tctxt;
+  int reuse, re_flags, eflags, len;
+  struct re_cache *cache;
+  struct re_entry *entry;
+  regmatch_t match[1];
 
   if (nargs < 2 || nargs > 3)
     {
@@ -438,21 +1137,571 @@ pre_filter (xmlXPathParserContextPtr ctxt, int nargs)
       return;
     }
 
+  reuse = 0;
   re_flags = REG_EXTENDED;
   if (nargs == 3 && (flags = xmlXPathPopString (ctxt)) != NULL)
     {
-      for (p = flags; *p != '\0'; p++)
-	switch (*p)
-	  {
-	  case 'g':
-	    break;
-	  case 'i':
-	    re_flags |= REG_ICASE;
-	    break;
-	  case 'm':
-	    re_flags |= REG_NEWLINE;
+      re_flags = parse_flags (flags, NULL, &reuse);
+      xmlSafeFree (flags);
+    }
+
+  pattern = xmlXPathPopString (ctxt);
+  if (xmlXPathCheckError (ctxt) || pattern == NULL)
+    {
+      xmlSafeFree (pattern);
+      return;
+    }
+
+  string = xmlXPathPopString (ctxt);
+  if (xmlXPathCheckError (ctxt) || string == NULL)
+    {
+      xmlSafeFree (string);
+      xmlSafeFree (pattern);
+      return;
+    }
+
+  tctxt = xsltXPathGetTransformContext (ctxt);
+  cache = re_get_cache (ctxt);
+  container = match_container (tctxt, cache, reuse);
+  if (container == NULL)
+    {
+      xmlSafeFree (string);
+      xmlSafeFree (pattern);
+      return;
+    }
+
+  ret = xmlXPathNewNodeSet (NULL);
+  if (ret == NULL)
+    {
+      xmlSafeFree (string);
+      xmlSafeFree (pattern);
+      return;
+    }
+
+  len = xmlStrlen (string);
+  if (len > 0 && (entry = re_compile (cache, pattern, re_flags)) != NULL)
+    {
+      /* a single pass over the string, empty matches don't separate */
+      start = tail = string;
+      eflags = 0;
+      while (tail != NULL
+	     && re_exec (entry, tail, len - (tail - string),
+			 1, match, eflags) == 0)
+	{
+	  if (match[0].rm_so < match[0].rm_eo)
+	    {
+	      node = token_element (container, start,
+				    tail + match[0].rm_so - start);
+	      if (node != NULL)
+		xmlXPathNodeSetAddUnique (ret->nodesetval, node);
+	      start = tail + match[0].rm_eo;
+	    }
+	  tail = re_advance (tail, match);
+	  eflags = REG_NOTBOL;
+	}
+      node = token_element (container, start, string + len - start);
+      if (node != NULL)
+	xmlXPathNodeSetAddUnique (ret->nodesetval, node);
+      re_release (cache, entry);
+    }
+
+  /* remember the fragment if it can be reused */
+  if (reuse && cache != NULL && container->last != NULL)
+    {
+      cache->rvt = container;
+      cache->rvt_last = container->last;
+    }
+
+  valuePush (ctxt, ret);
+
+  xmlSafeFree (string);
+  xmlSafeFree (pattern);
+}
+
+/****************************************************************************
+ * pre_test:
+ *
+ * Returns TRUE if the  RE matches the string.
+ ****************************************************************************/
+static void
+pre_test (xmlXPathParserContextPtr ctxt, int nargs)
+{
+  xmlChar *string, *pattern, *flags;
+  int match, re_flags;
+  struct re_cache *cache;
+  struct re_entry *entry;
+
+  if (nargs < 2 || nargs > 3)
+    {
+      xmlXPathSetArityError (ctxt);
+      return;
+    }
+
+  re_flags = REG_EXTENDED;
+  if (nargs == 3 && (flags = xmlXPathPopString (ctxt)) != NULL)
+    {
+      re_flags = parse_flags (flags, NULL, NULL);
+      xmlSafeFree (flags);
+    }
+
+  pattern = xmlXPathPopString (ctxt);
+  if (xmlXPathCheckError (ctxt) || pattern == NULL)
+    {
+      xmlSafeFree (pattern);
+      return;
+    }
+
+  string = xmlXPathPopString (ctxt);
+  if (xmlXPathCheckError (ctxt) || string == NULL)
+    {
+      xmlSafeFree (string);
+      xmlSafeFree (pattern);
+      return;
+    }
+
+  match = 0;
+  cache = re_get_cache (ctxt);
+  if ((entry = re_compile (cache, pattern, re_flags)) != NULL)
+    {
+      match = re_exec (entry, string, -1, 0, NULL, 0) == 0;
+      re_release (cache, entry);
+    }
+  xmlXPathReturnBoolean (ctxt, match);
+
+  xmlSafeFree (string);
+  xmlSafeFree (pattern);
+}
+
+/****************************************************************************
+ * pre_test_any, pre_which:
+ *
+ * Match a string against a set of patterns in a single pass.
+ ****************************************************************************/
+
+static void
+free_patterns (xmlChar **patterns, int npatterns)
+{
+  int i;
+
+  for (i = 0; i < npatterns; i++)
+    xmlFree (patterns[i]);
+  xmlSafeFree (patterns);
+}
+
+/* Pop a set of patterns, either the string values of the nodes in a
+   node-set or the lines of a string ignoring blank lines.  Returns the
+   number of patterns or -1 on error. */
+static int
+pop_patterns (xmlXPathParserContextPtr ctxt, xmlChar ***ppatterns)
+{
+  xmlXPathObjectPtr obj;
+  xmlChar **patterns;
+  const xmlChar *p, *q, *r;
+  int npatterns, n, i;
+
+  *ppatterns = NULL;
+  if ((obj = valuePop (ctxt)) == NULL)
+    return -1;
+  patterns = NULL;
+  npatterns = 0;
+  if (obj->type == XPATH_NODESET)
+    {
+      n = obj->nodesetval != NULL ? obj->nodesetval->nodeNr : 0;
+      if (n > 0 && (patterns = xmlMalloc (n * sizeof (xmlChar *))) == NULL)
+	n = -1;
+      for (i = 0; i < n; i++)
+	{
+	  patterns[i] = xmlXPathCastNodeToString (obj->nodesetval->nodeTab[i]);
+	  if (patterns[i] == NULL)
 	    break;
-	  }
+	  npatterns++;
+	}
+      if (npatterns < n)
+	n = -1;
+    }
+  else
+    {
+      obj = xmlXPathConvertString (obj);
+      for (n = 1, p = obj->stringval; *p != '\0'; p++)
+	if (*p == '\n')
+	  n++;
+      if ((patterns = xmlMalloc (n * sizeof (xmlChar *))) == NULL)
+	n = -1;
+      for (p = obj->stringval; n >= 0 && *p != '\0'; p = q)
+	{
+	  for (q = p; *q != '\0' && *q != '\n'; q++)
+	    ;
+	  for (r = p; r < q && isspace (*r); r++)
+	    ;
+	  if (r < q && (patterns[npatterns++] = xmlStrndup (p, q - p)) == NULL)
+	    n = -1;
+	  if (*q == '\n')
+	    q++;
+	}
+    }
+  xmlXPathFreeObject (obj);
+  if (n < 0)
+    {
+      free_patterns (patterns, npatterns);
+      return -1;
+    }
+  *ppatterns = patterns;
+  return npatterns;
+}
+
+/* Return the 1-based index of the first pattern in the set which matches
+   the string or zero if none match.  If any is non-zero, the result is
+   non-zero as soon as any pattern matches. */
+static int
+test_set (xmlXPathParserContextPtr ctxt, int nargs, int any)
+{
+  xmlChar *string, *flags, **patterns;
+  int npatterns, match, re_flags;
+  struct re_cache *cache;
+  struct re_entry *entry;
+
+  re_flags = REG_EXTENDED;
+  if (nargs == 3 && (flags = xmlXPathPopString (ctxt)) != NULL)
+    {
+      re_flags = parse_flags (flags, NULL, NULL);
+      xmlSafeFree (flags);
+    }
+
+  npatterns = pop_patterns (ctxt, &patterns);
+  if (xmlXPathCheckError (ctxt) || npatterns < 0)
+    return 0;
+
+  string = xmlXPathPopString (ctxt);
+  if (xmlXPathCheckError (ctxt) || string == NULL)
+    {
+      xmlSafeFree (string);
+      free_patterns (patterns, npatterns);
+      return 0;
+    }
+
+  match = 0;
+  cache = re_get_cache (ctxt);
+  if (npatterns > 0
+      && (entry = re_compile_set (cache, patterns, npatterns, re_flags)) != NULL)
+    {
+      if (any)
+	match = nfa_exec (entry->nfa, (const char *) string, 0, NULL, 0) == 0;
+      else
+	match = nfa_exec_set (entry->nfa, (const char *) string, 0) + 1;
+      re_release (cache, entry);
+    }
+
+  xmlSafeFree (string);
+  free_patterns (patterns, npatterns);
+  return match < 0 ? 0 : match;
+}
+
+/* Returns TRUE if any pattern in the set matches the string. */
+static void
+pre_test_any (xmlXPathParserContextPtr ctxt, int nargs)
+{
+  int match;
+
+  if (nargs < 2 || nargs > 3)
+    {
+      xmlXPathSetArityError (ctxt);
+      return;
+    }
+  match = test_set (ctxt, nargs, 1);
+  if (!xmlXPathCheckError (ctxt))
+    xmlXPathReturnBoolean (ctxt, match);
+}
+
+/* Returns the index of the first pattern in the set to match the string. */
+static void
+pre_which (xmlXPathParserContextPtr ctxt, int nargs)
+{
+  int match;
+
+  if (nargs < 2 || nargs > 3)
+    {
+      xmlXPathSetArityError (ctxt);
+      return;
+    }
+  match = test_set (ctxt, nargs, 0);
+  if (!xmlXPathCheckError (ctxt))
+    xmlXPathReturnNumber (ctxt, match);
+}
+
+/* Return the string value of a node.  Where the value is held by a single
+   text node it is returned directly, otherwise the content is gathered
+   into the scratch buffer which is reused from node to node.  The result
+   is valid until the next call. */
+static const xmlChar *
+node_content (xmlNode *node, xmlBuffer *scratch)
+{
+  xmlNode *child;
+
+  switch (node->type)
+    {
+    case XML_TEXT_NODE:
+    case XML_CDATA_SECTION_NODE:
+    case XML_COMMENT_NODE:
+    case XML_PI_NODE:
+      return node->content != NULL ? node->content : cX "";
+    case XML_ELEMENT_NODE:
+    case XML_ATTRIBUTE_NODE:
+      if ((child = node->children) == NULL)
+	return cX "";
+      if (child->next == NULL
+	  && (child->type == XML_TEXT_NODE
+	      || (child->type == XML_CDATA_SECTION_NODE
+		  && node->type == XML_ELEMENT_NODE)))
+	return child->content != NULL ? child->content : cX "";
+      break;
+    default:
+      break;
+    }
+
+  xmlBufferEmpty (scratch);
+  if (xmlNodeBufGetContent (scratch, node) != 0)
+    return NULL;
+  return xmlBufferContent (scratch);
+}
+
+static int
+filter_test (struct re_entry *entry, xmlNode *node, xmlBuffer *scratch)
+{
+  const xmlChar *string;
+
+  string = node_content (node, scratch);
+  return string != NULL && re_exec (entry, string, -1, 0, NULL, 0) == 0;
+}
+
+/****************************************************************************
+ * Parallel filter.
+ *
+ * Large node-sets are divided into contiguous slices which are tested
+ * concurrently, recording the outcome for each node in a flag array so
+ * that the result can be assembled in the original order.  Matching only
+ * reads the tree, however neither a glibc regex_t nor the linear matcher's
+ * state may be shared between threads, so each worker keeps its own cache
+ * of compiled patterns.  The workers form a pool which is started the first
+ * time it is needed and shared by every call.  The calling thread tests the
+ * first slice using its cached pattern, then takes back any of its slices
+ * which no worker has started and tests those as well as any slice whose
+ * worker failed, so that a call completes even when every worker is busy.
+ ****************************************************************************/
+
+struct filter_job
+  {
+    xmlNode **nodes;
+    int nnodes;
+    char *hits;
+    const xmlChar *pattern;
+    int cflags;
+    int status;
+    int *pending;			/* the call's unfinished jobs */
+    struct filter_job *next;		/* in the queue */
+  };
+
+static struct
+  {
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    struct filter_job *head, *tail;	/* jobs not yet started */
+    pthread_t tid[FILTER_MAX_THREADS];
+    int nthreads;
+    int quit;
+  }
+pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+	 PTHREAD_COND_INITIALIZER, NULL, NULL, { 0 }, 0, 0 };
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void
+filter_slice (struct re_entry *entry, struct filter_job *job,
+	      xmlBuffer *scratch)
+{
+  int i;
+
+  for (i = 0; i < job->nnodes; i++)
+    job->hits[i] = filter_test (entry, job->nodes[i], scratch);
+}
+
+static void *
+filter_worker (void *arg _unused)
+{
+  struct filter_job *job;
+  struct re_cache *cache;
+  struct re_entry *entry;
+
+  if ((cache = re_ctxt_init (NULL, NULL)) != NULL
+      && (cache->scratch = xmlBufferCreate ()) != NULL)
+    xmlBufferSetAllocationScheme (cache->scratch, XML_BUFFER_ALLOC_DOUBLEIT);
+
+  pthread_mutex_lock (&pool.lock);
+  for (;;)
+    {
+      while (pool.head == NULL && !pool.quit)
+	pthread_cond_wait (&pool.work, &pool.lock);
+      if (pool.quit)
+	break;
+      job = pool.head;
+      if ((pool.head = job->next) == NULL)
+	pool.tail = NULL;
+      pthread_mutex_unlock (&pool.lock);
+
+      if (cache != NULL && cache->scratch != NULL
+	  && (entry = re_compile (cache, job->pattern, job->cflags)) != NULL)
+	{
+	  filter_slice (entry, job, cache->scratch);
+	  job->status = 0;
+	}
+      /* don't hold on to an unusually large buffer */
+      if (cache != NULL && cache->scratch != NULL
+	  && cache->scratch->size > SCRATCH_MAX)
+	{
+	  xmlBufferFree (cache->scratch);
+	  if ((cache->scratch = xmlBufferCreate ()) != NULL)
+	    xmlBufferSetAllocationScheme (cache->scratch,
+					  XML_BUFFER_ALLOC_DOUBLEIT);
+	}
+
+      pthread_mutex_lock (&pool.lock);
+      (*job->pending)--;
+      pthread_cond_broadcast (&pool.done);
+    }
+  pthread_mutex_unlock (&pool.lock);
+  re_ctxt_shutdown (NULL, NULL, cache);
+  return NULL;
+}
+
+static int
+filter_threads (void)
+{
+  long n = RE_FILTER_THREADS;
+
+  if (n <= 0 && (n = sysconf (_SC_NPROCESSORS_ONLN)) < 1)
+    n = 1;
+  return n > FILTER_MAX_THREADS ? FILTER_MAX_THREADS : n;
+}
+
+/* Start the workers, the calling thread being the remaining one */
+static void
+filter_pool_start (void)
+{
+  int t, n;
+
+  n = filter_threads () - 1;
+  for (t = 0; t < n; t++)
+    if (pthread_create (&pool.tid[pool.nthreads], NULL, filter_worker,
+			NULL) == 0)
+      pool.nthreads++;
+}
+
+/* Stop the workers before the module is unloaded */
+static void __attribute__((destructor))
+filter_pool_stop (void)
+{
+  int t;
+
+  pthread_mutex_lock (&pool.lock);
+  pool.quit = 1;
+  pthread_cond_broadcast (&pool.work);
+  pthread_mutex_unlock (&pool.lock);
+  for (t = 0; t < pool.nthreads; t++)
+    pthread_join (pool.tid[t], NULL);
+  pool.nthreads = 0;
+}
+
+static void
+filter_parallel (struct re_entry *entry, const xmlChar *pattern, int cflags,
+		 xmlNode **nodes, int nnodes, char *hits, xmlBuffer *scratch,
+		 int nthreads)
+{
+  struct filter_job job[FILTER_MAX_THREADS], **link;
+  int t, size, start, pending;
+
+  pthread_once (&pool_once, filter_pool_start);
+
+  size = (nnodes + nthreads - 1) / nthreads;
+  for (t = 0; t < nthreads; t++)
+    {
+      start = t * size < nnodes ? t * size : nnodes;
+      job[t].nodes = nodes + start;
+      job[t].hits = hits + start;
+      job[t].nnodes = nnodes - start < size ? nnodes - start : size;
+      job[t].pattern = pattern;
+      job[t].cflags = cflags;
+      job[t].status = -1;
+      job[t].pending = &pending;
+      job[t].next = NULL;
+    }
+
+  pthread_mutex_lock (&pool.lock);
+  pending = 0;
+  if (pool.nthreads > 0)
+    for (t = 1; t < nthreads; t++)
+      {
+	if (pool.tail != NULL)
+	  pool.tail->next = &job[t];
+	else
+	  pool.head = &job[t];
+	pool.tail = &job[t];
+	pending++;
+      }
+  pthread_cond_broadcast (&pool.work);
+  pthread_mutex_unlock (&pool.lock);
+
+  filter_slice (entry, &job[0], scratch);
+
+  /* take back the jobs no worker has started and wait for the others */
+  pthread_mutex_lock (&pool.lock);
+  pool.tail = NULL;
+  for (link = &pool.head; *link != NULL; )
+    if ((*link)->pending == &pending)
+      {
+	*link = (*link)->next;
+	pending--;
+      }
+    else
+      {
+	pool.tail = *link;
+	link = &(*link)->next;
+      }
+  while (pending > 0)
+    pthread_cond_wait (&pool.done, &pool.lock);
+  pthread_mutex_unlock (&pool.lock);
+
+  for (t = 1; t < nthreads; t++)
+    if (job[t].status != 0)
+      filter_slice (entry, &job[t], scratch);
+}
+
+/****************************************************************************
+ * pre_filter:
+ *
+ * Filter the node-set specified by the first argument.  For each
+ * node cast to a string and if it matches the RE add it to the result
+ * node-set.  Remaining arguments are as per test().
+ ****************************************************************************/
+static void
+pre_filter (xmlXPathParserContextPtr ctxt, int nargs)
+{
+  xmlChar *pattern, *flags;
+  xmlXPathObject *set, *obj;
+  xmlNode **nodes;
+  xmlBuffer *scratch;
+  char *hits;
+  int re_flags, i, n, nthreads, match;
+  struct re_cache *cache;
+  struct re_entry *entry;
+
+  if (nargs < 2 || nargs > 3)
+    {
+      xmlXPathSetArityError (ctxt);
+      return;
+    }
+
+  re_flags = REG_EXTENDED;
+  if (nargs == 3 && (flags = xmlXPathPopString (ctxt)) != NULL)
+    {
+      re_flags = parse_flags (flags, NULL, NULL);
       xmlSafeFree (flags);
     }
 
@@ -473,17 +1722,48 @@ pre_filter (xmlXPathParserContextPtr ctxt, int nargs)
   set = xmlXPathNewNodeSet (NULL);
   if (obj->type == XPATH_NODESET && obj->nodesetval != NULL)
     {
-      if (regcomp (&re, (char *) pattern, re_flags) == 0)
+      cache = re_get_cache (ctxt);
+      if (cache != NULL)
 	{
-	  for (i = 0; i < obj->nodesetval->nodeNr; i++)
+	  if (cache->scratch == NULL
+	      && (cache->scratch = xmlBufferCreate ()) != NULL)
+	    xmlBufferSetAllocationScheme (cache->scratch,
+					  XML_BUFFER_ALLOC_DOUBLEIT);
+	  scratch = cache->scratch;
+	}
+      else if ((scratch = xmlBufferCreate ()) != NULL)
+	xmlBufferSetAllocationScheme (scratch, XML_BUFFER_ALLOC_DOUBLEIT);
+      if (scratch != NULL
+	  && (entry = re_compile (cache, pattern, re_flags)) != NULL)
+	{
+	  nodes = obj->nodesetval->nodeTab;
+	  n = obj->nodesetval->nodeNr;
+	  hits = NULL;
+	  if (n >= RE_FILTER_THRESHOLD && (nthreads = filter_threads ()) > 1
+	      && (hits = xmlMalloc (n)) != NULL)
+	    filter_parallel (entry, pattern, re_flags, nodes, n, hits, scratch,
+			     nthreads);
+	  for (i = 0; i < n; i++)
 	    {
-	      node = obj->nodesetval->nodeTab[i];
-	      string = xmlNodeGetContent (node);
-	      if (regexec (&re, (char *) string, 0, NULL, 0) == 0)
-		xmlXPathNodeSetAdd (set->nodesetval, node);
-	      xmlSafeFree (string);
+	      if (hits != NULL)
+		match = hits[i];
+	      else
+		match = filter_test (entry, nodes[i], scratch);
+	      /* nodes in the argument are already distinct so the result
+		 does not need to be checked for duplicates */
+	      if (match)
+		xmlXPathNodeSetAddUnique (set->nodesetval, nodes[i]);
 	    }
-	  regfree (&re);
+	  xmlSafeFree (hits);
+	  re_release (cache, entry);
+	}
+      /* don't hold on to an unusually large buffer */
+      if (scratch != NULL
+	  && (cache == NULL || scratch->size > SCRATCH_MAX))
+	{
+	  xmlBufferFree (scratch);
+	  if (cache != NULL)
+	    cache->scratch = NULL;
 	}
     }
   valuePush (ctxt, set);
@@ -502,8 +1782,18 @@ pre_filter (xmlXPathParserContextPtr ctxt, int nargs)
 void
 xsltRegexpRegister (void)
 {
-  xsltRegisterExtModuleFunction (cX "replace", XSLT_REGEXP_NAMESPACE, pre_replace);
-  xsltRegisterExtModuleFunction (cX "match", XSLT_REGEXP_NAMESPACE, pre_match);
-  xsltRegisterExtModuleFunction (cX "test", XSLT_REGEXP_NAMESPACE, pre_test);
-  xsltRegisterExtModuleFunction (cX "filter", XSLT_REGEXP_NAMESPACE, pre_filter);
+  xsltRegisterExtModule (XSLT_REGEXP_NAMESPACE, re_ctxt_init, re_ctxt_shutdown);
+  stats_init (XSLT_REGEXP_NAMESPACE);
+  stats_register_function (cX "replace", XSLT_REGEXP_NAMESPACE, pre_replace);
+  stats_register_function (cX "match", XSLT_REGEXP_NAMESPACE, pre_match);
+  stats_register_function (cX "match-count", XSLT_REGEXP_NAMESPACE,
+			   pre_match_count);
+  stats_register_function (cX "group", XSLT_REGEXP_NAMESPACE, pre_group);
+  stats_register_function (cX "tokenize", XSLT_REGEXP_NAMESPACE,
+			   pre_tokenize);
+  stats_register_function (cX "test", XSLT_REGEXP_NAMESPACE, pre_test);
+  stats_register_function (cX "test-any", XSLT_REGEXP_NAMESPACE,
+			   pre_test_any);
+  stats_register_function (cX "which", XSLT_REGEXP_NAMESPACE, pre_which);
+  stats_register_function (cX "filter", XSLT_REGEXP_NAMESPACE, pre_filter);
 }
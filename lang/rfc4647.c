@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "rfc4647.h"
 
@@ -102,3 +103,118 @@ rfc4647_extended_match (const char *lang, const char *range)
 	succeeds.  */
   return 1;
 }
+
+/* A compiled range holds the subtags of a range for matching many tags
+   against it.  Each subtag is a length byte followed by the subtag in
+   lower case, so a match is a single pass over the tag comparing bytes. */
+
+#define SUBTAG_MAX	255
+
+static int
+lower (int c)
+{
+  return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+}
+
+/* Compile the range, or return NULL if it has a subtag longer than
+   SUBTAG_MAX or memory is exhausted.  Free the result with
+   rfc4647_free_range() */
+struct rfc4647_range *
+rfc4647_compile_range (const char *range)
+{
+  struct rfc4647_range *compiled;
+  unsigned char *out;
+  const char *p, *end;
+  size_t len;
+
+  /* each '-' becomes a length byte so the subtags fit in strlen + 1 */
+  len = strlen (range);
+  if ((compiled = malloc (sizeof (struct rfc4647_range) + len + 1)) == NULL)
+    return NULL;
+  out = compiled->subtags;
+  p = range;
+  do
+    {
+      if ((end = strchr (p, '-')) == NULL)
+	end = strchr (p, '\0');
+      if (end - p > SUBTAG_MAX)
+	{
+	  free (compiled);
+	  return NULL;
+	}
+      *out++ = end - p;
+      while (p < end)
+	*out++ = lower (*p++);
+      /* as in rfc4647_extended_match() a trailing '-' ends the range */
+      if (*p == '-')
+	p++;
+    }
+  while (*p != '\0');
+  compiled->size = out - compiled->subtags;
+  return compiled;
+}
+
+void
+rfc4647_free_range (struct rfc4647_range *range)
+{
+  free (range);
+}
+
+/* Return 1 if the tag's subtag at lang has the length and lower case
+   characters of the compiled subtag */
+static inline int
+subtag_equal (const char *lang, const unsigned char *subtag)
+{
+  int i;
+
+  for (i = 0; i < subtag[0]; i++)
+    if (lower ((unsigned char) lang[i]) != subtag[i + 1])
+      return 0;
+  return lang[i] == '-' || lang[i] == '\0';
+}
+
+static inline const char *
+next_subtag (const char *lang)
+{
+  while (*lang != '-' && *lang != '\0')
+    lang++;
+  return *lang == '-' ? lang + 1 : lang;
+}
+
+#define IS_WILDCARD(s)	((s)[0] == 1 && (s)[1] == '*')
+
+/* Return 1 if lang matches the compiled range, with the same result as
+   rfc4647_extended_match() for the range it was compiled from */
+int
+rfc4647_range_match (const char *lang, const struct rfc4647_range *range)
+{
+  const unsigned char *subtag, *end;
+
+  subtag = range->subtags;
+  end = subtag + range->size;
+
+  /* 2. the first subtags must match */
+  if (!IS_WILDCARD (subtag) && !subtag_equal (lang, subtag))
+    return 0;
+  subtag += 1 + subtag[0];
+  lang = next_subtag (lang);
+
+  /* 3. while there are more subtags in the range */
+  while (subtag < end)
+    if (IS_WILDCARD (subtag))					/* A */
+      subtag += 2;
+    else if (*lang == '\0')					/* B */
+      return 0;
+    else if (subtag_equal (lang, subtag))			/* C */
+      {
+	subtag += 1 + subtag[0];
+	lang = next_subtag (lang);
+      }
+    else if (lang[0] != '-' && (lang[1] == '-' || lang[1] == '\0')) /* D */
+      return 0;
+    else							/* E */
+      lang = next_subtag (lang);
+
+  /* 4. the range has no more subtags */
+  return 1;
+}
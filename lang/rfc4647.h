@@ -1,8 +1,20 @@
 #ifndef _rfc4647_h
 #define _rfc4647_h
 
+#include <stddef.h>
+
 int rfc4647_extended_match (const char *lang, const char *range);
 
+struct rfc4647_range
+  {
+    size_t size;		/* length of subtags */
+    unsigned char subtags[];
+  };
+
+struct rfc4647_range *rfc4647_compile_range (const char *range);
+void rfc4647_free_range (struct rfc4647_range *range);
+int rfc4647_range_match (const char *lang, const struct rfc4647_range *range);
+
 char *canonic_tag (char *buf, size_t bufsize, const char *tag, int full);
 
 #endif
@@ -1,4 +1,5 @@
 #include <ctype.h>
+#include <stdint.h>
 #include <string.h>
 
 #include <libxml/globals.h>
@@ -7,6 +8,9 @@
 #include <libxml/xpathInternals.h>
 #include <libxml/parser.h>
 #include <libxml/encoding.h>
+#include <libxml/hash.h>
+#include <libxml/dict.h>
+#include <libxml/threads.h>
 
 #include <libxslt/xsltconfig.h>
 #include <libxslt/xsltutils.h>
@@ -15,6 +19,7 @@
 
 #include "xslt-lang.h"
 #include "rfc4647.h"
+#include "stats.h"
 
 #if !defined (__GNUC__) || __GNUC__ < 2
 # define __attribute__(x)
@@ -24,6 +29,430 @@
 static int scan_range (const char *, const char **, char *, size_t);
 static int scan_name (const char *, const char **, char *, size_t);
 
+/****************************************************************************
+ * Transformation data
+ ****************************************************************************/
+
+#define RANGE_CACHE	1024		/* compiled ranges per transformation */
+
+struct lang_doc;
+struct lang_index;
+
+struct lang_ctxt
+  {
+    xmlHashTable *ranges;		/* compiled lang() ranges */
+    xmlDict *dict;			/* tags when the global dict is full */
+    struct lang_doc *docs;		/* languages of elements */
+    struct lang_index *indexes;		/* accept-lang() node-sets */
+  };
+
+static void lang_docs_free (struct lang_doc *docs);
+static void lang_index_free (struct lang_index *index);
+
+static void *
+lang_ctxt_init (xsltTransformContext *tctxt _unused, const xmlChar *uri _unused)
+{
+  struct lang_ctxt *data;
+
+  if ((data = xmlMalloc (sizeof (struct lang_ctxt))) == NULL)
+    return NULL;
+  memset (data, 0, sizeof (struct lang_ctxt));
+  if ((data->dict = xmlDictCreate ()) == NULL)
+    {
+      xmlFree (data);
+      return NULL;
+    }
+  return data;
+}
+
+static void
+free_range (void *payload, const xmlChar *name _unused)
+{
+  rfc4647_free_range (payload);
+}
+
+static void
+lang_ctxt_shutdown (xsltTransformContext *tctxt _unused,
+		    const xmlChar *uri _unused, void *ptr)
+{
+  struct lang_ctxt *data = ptr;
+
+  if (data == NULL)
+    return;
+  if (data->ranges != NULL)
+    xmlHashFree (data->ranges, free_range);
+  lang_docs_free (data->docs);
+  lang_index_free (data->indexes);
+  xmlDictFree (data->dict);
+  xmlFree (data);
+}
+
+static struct lang_ctxt *
+lang_get_ctxt (xmlXPathParserContextPtr ctxt)
+{
+  xsltTransformContext *tctxt;
+
+  if ((tctxt = xsltXPathGetTransformContext (ctxt)) == NULL)
+    return NULL;
+  return xsltGetExtData (tctxt, XSLT_LANG_NAMESPACE);
+}
+
+/* Return the range compiled for matching, which remains valid for the rest
+   of the transformation, or NULL if it must be matched as a string */
+static const struct rfc4647_range *
+lang_range (struct lang_ctxt *data, const char *range)
+{
+  struct rfc4647_range *compiled;
+
+  if (data == NULL)
+    return NULL;
+  if (data->ranges == NULL && (data->ranges = xmlHashCreate (16)) == NULL)
+    return NULL;
+  if ((compiled = xmlHashLookup (data->ranges, cX range)) != NULL)
+    return compiled;
+  if (xmlHashSize (data->ranges) >= RANGE_CACHE
+      || (compiled = rfc4647_compile_range (range)) == NULL)
+    return NULL;
+  if (xmlHashAddEntry (data->ranges, cX range, compiled) != 0)
+    {
+      rfc4647_free_range (compiled);
+      return NULL;
+    }
+  return compiled;
+}
+
+/****************************************************************************
+ * Interned tags
+ *
+ * Language tags and their canonical forms are interned in a dictionary
+ * shared by all transformations so that equal tags are the same pointer,
+ * and the result of canonic_tag() is remembered for each tag.  Only valid
+ * tags are shared, so arbitrary strings cannot fill the dictionary.
+ * Documents use few distinct tags; should there be more than TAGS_MAX any
+ * others, and invalid tags, are interned for the transformation only.
+ ****************************************************************************/
+
+#define TAGS_MAX	4096
+#define TAG_MAX		256	/* size of a shared tag with its NUL */
+
+static xmlMutex *tags_lock;
+static xmlDict *tags;
+static xmlHashTable *canonic_tags[2];	/* canonic_tag() by tag and full */
+static const xmlChar invalid_tag[] = "";
+
+static void
+tags_init (void)
+{
+  if ((tags = xmlDictCreate ()) == NULL
+      || (canonic_tags[0] = xmlHashCreateDict (64, tags)) == NULL
+      || (canonic_tags[1] = xmlHashCreateDict (64, tags)) == NULL)
+    return;
+  tags_lock = xmlNewMutex ();
+}
+
+/* Return the tag interned, or NULL if memory is exhausted.  When data is
+   NULL the tag is only interned if it can be shared, otherwise NULL. */
+static const xmlChar *
+tag_intern (struct lang_ctxt *data, const xmlChar *tag)
+{
+  const xmlChar *interned;
+  char ctag[TAG_MAX];
+
+  interned = NULL;
+  if (tags_lock != NULL && xmlStrlen (tag) < TAG_MAX)
+    {
+      xmlMutexLock (tags_lock);
+      interned = xmlDictExists (tags, tag, -1);
+      xmlMutexUnlock (tags_lock);
+      if (interned == NULL
+	  && canonic_tag (ctag, sizeof ctag, (const char *) tag, 1) != NULL)
+	{
+	  xmlMutexLock (tags_lock);
+	  if (xmlDictSize (tags) < TAGS_MAX)
+	    interned = xmlDictLookup (tags, tag, -1);
+	  xmlMutexUnlock (tags_lock);
+	}
+    }
+  if (interned == NULL && data != NULL)
+    interned = xmlDictLookup (data->dict, tag, -1);
+  return interned;
+}
+
+/* Return the interned canonical form of the interned tag, as canonic_tag()
+   finds it, or NULL if the tag is not valid or it cannot be interned */
+static const xmlChar *
+tag_canonic (struct lang_ctxt *data, const xmlChar *tag, int full)
+{
+  const xmlChar *canonic;
+  char ctag[TAG_MAX];
+
+  canonic = NULL;
+  if (tags_lock != NULL)
+    {
+      xmlMutexLock (tags_lock);
+      canonic = xmlHashLookup (canonic_tags[full], tag);
+      xmlMutexUnlock (tags_lock);
+    }
+  if (canonic == NULL)
+    {
+      if (canonic_tag (ctag, sizeof ctag, (const char *) tag, full) == NULL)
+	canonic = invalid_tag;
+      else if ((canonic = tag_intern (data, cX ctag)) == NULL)
+	return NULL;
+      /* only remember tags which outlive the transformation */
+      if (tags_lock != NULL)
+	{
+	  xmlMutexLock (tags_lock);
+	  if (xmlDictOwns (tags, tag) == 1
+	      && (canonic == invalid_tag || xmlDictOwns (tags, canonic) == 1))
+	    xmlHashAddEntry (canonic_tags[full], tag, (void *) canonic);
+	  xmlMutexUnlock (tags_lock);
+	}
+    }
+  return canonic != invalid_tag ? canonic : NULL;
+}
+
+/****************************************************************************
+ * Languages of elements
+ *
+ * The first time the language of a node in the source document or a
+ * document loaded by document() is needed, the whole document is walked
+ * once and the inherited xml:lang of every element which has one is
+ * recorded with its canonical form, both interned, so that each later
+ * lookup is a hash probe.  These documents are not modified during the
+ * transformation; other nodes use xmlNodeGetLang() as before.
+ ****************************************************************************/
+
+struct lang_entry
+  {
+    const xmlNode *node;
+    const xmlChar *lang, *canonic;	/* interned in dict */
+  };
+
+struct lang_doc
+  {
+    const xmlDoc *doc;
+    struct lang_entry *table;		/* elements with a language */
+    unsigned size, count;		/* size is a power of 2 */
+    struct lang_doc *next;
+  };
+
+/* Hash of a node's or interned tag's address for the tables */
+static inline unsigned
+ptr_hash (const void *ptr)
+{
+  return (unsigned) ((((uintptr_t) ptr >> 4) * 0x9e3779b1u) >> 8);
+}
+
+static void
+lang_docs_free (struct lang_doc *docs)
+{
+  struct lang_doc *next;
+
+  for (; docs != NULL; docs = next)
+    {
+      next = docs->next;
+      xmlFree (docs->table);
+      xmlFree (docs);
+    }
+}
+
+static struct lang_entry *
+lang_probe (struct lang_entry *table, unsigned size, const xmlNode *node)
+{
+  struct lang_entry *entry;
+  unsigned h;
+
+  for (h = ptr_hash (node); ; h++)
+    {
+      entry = &table[h & (size - 1)];
+      if (entry->node == node || entry->node == NULL)
+	return entry;
+    }
+}
+
+static int
+lang_insert (struct lang_doc *ldoc, const xmlNode *node,
+	     const xmlChar *lang, const xmlChar *canonic)
+{
+  struct lang_entry *table, *entry;
+  unsigned size, i;
+
+  if (2 * (ldoc->count + 1) > ldoc->size)
+    {
+      size = ldoc->size * 2;
+      if ((table = xmlMalloc (size * sizeof (struct lang_entry))) == NULL)
+	return -1;
+      memset (table, 0, size * sizeof (struct lang_entry));
+      for (i = 0; i < ldoc->size; i++)
+	if (ldoc->table[i].node != NULL)
+	  *lang_probe (table, size, ldoc->table[i].node) = ldoc->table[i];
+      xmlFree (ldoc->table);
+      ldoc->table = table;
+      ldoc->size = size;
+    }
+  entry = lang_probe (ldoc->table, ldoc->size, node);
+  entry->node = node;
+  entry->lang = lang;
+  entry->canonic = canonic;
+  ldoc->count++;
+  return 0;
+}
+
+/* Return the interned xml:lang attribute of the element, NULL if it has
+   none or -1 on error */
+static int
+xml_lang (struct lang_ctxt *data, const xmlNode *node, const xmlChar **lang)
+{
+  xmlAttr *attr;
+  xmlChar *value;
+
+  *lang = NULL;
+  if ((attr = xmlHasNsProp (node, cX"lang", XML_XML_NAMESPACE)) == NULL)
+    return 0;
+  if (attr->type == XML_ATTRIBUTE_DECL)
+    *lang = tag_intern (data, ((xmlAttribute *) attr)->defaultValue);
+  else if (attr->children != NULL && attr->children->next == NULL
+	   && attr->children->type == XML_TEXT_NODE)
+    *lang = tag_intern (data, attr->children->content);
+  else
+    {
+      if ((value = xmlNodeGetContent ((xmlNode *) attr)) == NULL)
+	return -1;
+      *lang = tag_intern (data, value);
+      xmlFree (value);
+    }
+  return *lang != NULL ? 0 : -1;
+}
+
+/* Record the language of every element of the document */
+static int
+lang_walk (struct lang_ctxt *data, struct lang_doc *ldoc)
+{
+  const xmlNode *node;
+  const struct lang_entry *parent;
+  const xmlChar *lang, *canonic;
+
+  node = ldoc->doc->children;
+  while (node != NULL)
+    {
+      if (node->type == XML_ELEMENT_NODE)
+	{
+	  canonic = NULL;
+	  if (xml_lang (data, node, &lang) < 0)
+	    return -1;
+	  if (lang != NULL)
+	    {
+	      if ((canonic = tag_canonic (data, lang, 1)) == NULL)
+		canonic = lang;
+	    }
+	  else if (node->parent != NULL
+		   && node->parent->type == XML_ELEMENT_NODE)
+	    {
+	      parent = lang_probe (ldoc->table, ldoc->size, node->parent);
+	      lang = parent->lang;
+	      canonic = parent->canonic;
+	    }
+	  if (lang != NULL && lang_insert (ldoc, node, lang, canonic) < 0)
+	    return -1;
+	  if (node->children != NULL)
+	    {
+	      node = node->children;
+	      continue;
+	    }
+	}
+      while (node->next == NULL)
+	if ((node = node->parent) == NULL
+	    || node == (const xmlNode *) ldoc->doc)
+	  return 0;
+      node = node->next;
+    }
+  return 0;
+}
+
+/* Return the walked document containing the node or NULL if it is not
+   cached */
+static const struct lang_doc *
+lang_doc (xsltTransformContext *tctxt, struct lang_ctxt *data,
+	  const xmlDoc *doc)
+{
+  struct lang_doc *ldoc;
+  xsltDocument *xdoc;
+
+  for (ldoc = data->docs; ldoc != NULL; ldoc = ldoc->next)
+    if (ldoc->doc == doc)
+      return ldoc;
+
+  if (tctxt->document == NULL || tctxt->document->doc != doc)
+    {
+      for (xdoc = tctxt->docList; xdoc != NULL; xdoc = xdoc->next)
+	if (xdoc->doc == doc)
+	  break;
+      if (xdoc == NULL)
+	return NULL;
+    }
+
+  if ((ldoc = xmlMalloc (sizeof (struct lang_doc))) == NULL)
+    return NULL;
+  ldoc->doc = doc;
+  ldoc->size = 64;
+  ldoc->count = 0;
+  if ((ldoc->table = xmlMalloc (ldoc->size * sizeof (struct lang_entry)))
+      == NULL)
+    {
+      xmlFree (ldoc);
+      return NULL;
+    }
+  memset (ldoc->table, 0, ldoc->size * sizeof (struct lang_entry));
+  if (lang_walk (data, ldoc) < 0)
+    {
+      lang_docs_free (ldoc);
+      return NULL;
+    }
+  ldoc->next = data->docs;
+  data->docs = ldoc;
+  return ldoc;
+}
+
+/* Return the interned language of the node, or NULL if it has none, and
+   set *canonic to its interned canonical form or to the tag if it is not
+   valid */
+static const xmlChar *
+node_lang (xmlXPathParserContextPtr ctxt, struct lang_ctxt *data,
+	   const xmlNode *node, const xmlChar **canonic)
+{
+  xsltTransformContext *tctxt;
+  const struct lang_doc *ldoc;
+  const struct lang_entry *entry;
+  const xmlChar *lang;
+  xmlChar *value;
+
+  *canonic = NULL;
+  if (node == NULL || node->type == XML_NAMESPACE_DECL)
+    return NULL;
+  while (node != NULL && node->type != XML_ELEMENT_NODE)
+    node = node->parent;
+  if (node == NULL)
+    return NULL;
+
+  if (data != NULL && node->doc != NULL
+      && (tctxt = xsltXPathGetTransformContext (ctxt)) != NULL
+      && (ldoc = lang_doc (tctxt, data, node->doc)) != NULL)
+    {
+      entry = lang_probe (ldoc->table, ldoc->size, node);
+      *canonic = entry->canonic;
+      return entry->lang;
+    }
+
+  if ((value = xmlNodeGetLang (node)) == NULL)
+    return NULL;
+  lang = tag_intern (data, value);
+  xmlFree (value);
+  if (lang != NULL && (*canonic = tag_canonic (data, lang, 1)) == NULL)
+    *canonic = lang;
+  return lang;
+}
+
 /****************************************************************************
  * boolean lang:lang(string)
  *
@@ -34,7 +463,11 @@ static int scan_name (const char *, const char **, char *, size_t);
 static void
 lang_lang (xmlXPathParserContextPtr ctxt, int nargs)
 {
-  char *lang, *range;
+  struct lang_ctxt *data;
+  const struct rfc4647_range *compiled;
+  const xmlChar *canonic;
+  const char *lang;
+  char *range;
 
   if (nargs != 1)
     {
@@ -52,15 +485,16 @@ lang_lang (xmlXPathParserContextPtr ctxt, int nargs)
       return;
     }
 
-  lang = (char *) xmlNodeGetLang (ctxt->context->node);
+  data = lang_get_ctxt (ctxt);
+  lang = (const char *) node_lang (ctxt, data, ctxt->context->node, &canonic);
   if (lang == NULL)
     valuePush (ctxt, xmlXPathNewBoolean (0));
+  else if ((compiled = lang_range (data, range)) != NULL)
+    valuePush (ctxt, xmlXPathNewBoolean (rfc4647_range_match (lang, compiled)));
   else
     valuePush (ctxt, xmlXPathNewBoolean (rfc4647_extended_match (lang, range)));
   if (range != NULL)
     xmlFree (range);
-  if (lang != NULL)
-    xmlFree (lang);
 }
 
 /****************************************************************************
@@ -72,123 +506,427 @@ lang_lang (xmlXPathParserContextPtr ctxt, int nargs)
  * language tag list in order of decreasing preference.
  ****************************************************************************/
 
-/* Return the length of the common initial span for strings a and b
-   ignoring case for alpha characters */
-static int
-strncaseinitspan (const char *a, const char *b, int len)
+/* A language index groups the nodes of a node-set by language.  It is kept
+   for the rest of the transformation when all of the nodes belong to
+   documents which are not modified, so that calls with the same nodes,
+   such as a variable referenced in a loop, find the index again instead
+   of grouping the nodes each time.
+
+   The languages are also held in a trie of their subtags, compared
+   ignoring case, so that the language which is the longest prefix of a
+   range is found by following the range's subtags from the root rather
+   than by comparing the range with every language. */
+
+#define INDEX_CACHE	16		/* language indexes per transformation */
+
+struct lang_group
+  {
+    const xmlChar *tag;			/* interned canonical tag or NULL */
+    int start, count;			/* in grouped */
+  };
+
+struct trie_edge
+  {
+    unsigned hash;			/* of parent and subtag */
+    int parent, child;			/* 0 if the slot is empty */
+    const xmlChar *subtag;
+    int len;
+  };
+
+struct lang_index
+  {
+    unsigned hash;			/* of the nodes */
+    int nnodes;
+    xmlNode **nodes;			/* the node-set */
+    xmlNode **grouped;			/* the nodes in order of group */
+    struct lang_group *groups;		/* groups[0] has no language */
+    int ngroups, maxgroups;
+    int *table;				/* group of each tag by address */
+    unsigned size;			/* of table, a power of 2 */
+    int *trie;				/* group of each trie node or -1 */
+    struct trie_edge *edges;
+    unsigned nedges;			/* a power of 2 */
+    int longest;			/* group with the longest tag */
+    struct lang_index *next;
+  };
+
+static void
+lang_index_free (struct lang_index *index)
+{
+  struct lang_index *next;
+
+  for (; index != NULL; index = next)
+    {
+      next = index->next;
+      xmlFree (index->nodes);
+      xmlFree (index->grouped);
+      xmlFree (index->groups);
+      xmlFree (index->table);
+      xmlFree (index->trie);
+      xmlFree (index->edges);
+      xmlFree (index);
+    }
+}
+
+static unsigned
+nodes_hash (xmlNode **nodes, int nnodes)
+{
+  unsigned h;
+  int i;
+
+  for (h = nnodes, i = 0; i < nnodes; i++)
+    h = h * 31 + ptr_hash (nodes[i]);
+  return h;
+}
+
+/* Return the slot in the index's table for the tag, which is either its
+   group or -1 */
+static int *
+group_probe (const struct lang_index *index, const xmlChar *tag)
+{
+  int *slot;
+  unsigned h;
+
+  for (h = ptr_hash (tag); ; h++)
+    {
+      slot = &index->table[h & (index->size - 1)];
+      if (*slot < 0 || index->groups[*slot].tag == tag)
+	return slot;
+    }
+}
+
+static inline int
+lower (int c)
+{
+  return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+}
+
+static unsigned
+subtag_hash (int parent, const xmlChar *subtag, int len)
 {
-  const char *l = a;
+  unsigned h;
+  int i;
+
+  h = (unsigned) parent * 0x9e3779b1u;
+  for (i = 0; i < len; i++)
+    h = (h ^ lower (subtag[i])) * 16777619u;
+  return h;
+}
+
+/* Return the edge from parent for the subtag or the empty slot for it */
+static struct trie_edge *
+trie_probe (const struct lang_index *index, int parent,
+	    const xmlChar *subtag, int len)
+{
+  struct trie_edge *edge;
+  unsigned h, hash;
+  int i;
 
-  while (len > 0
-         && ((*l == *b && *l != '\0')
-	     || (isalpha (*l)
-	         && isalpha (*b)
-		 && (isupper (*l) ? (*l == toupper (*b)) : (toupper (*l) == *b))
-		)
-	    )
-	)
-    l++, b++, len--;
-  return l - a;
+  hash = subtag_hash (parent, subtag, len);
+  for (h = hash; ; h++)
+    {
+      edge = &index->edges[h & (index->nedges - 1)];
+      if (edge->child == 0)
+	return edge;
+      if (edge->hash == hash && edge->parent == parent && edge->len == len)
+	{
+	  for (i = 0; i < len && lower (edge->subtag[i]) == lower (subtag[i]);
+	       i++)
+	    ;
+	  if (i == len)
+	    return edge;
+	}
+    }
 }
 
+/* Build the trie of the subtags of the index's languages */
 static int
-compare_range (const char *lang, const char *range, int rlen)
+trie_build (struct lang_index *index)
 {
-  int len;
+  struct trie_edge *edge;
+  const xmlChar *tag, *p;
+  int nsubtags, nnodes, node, g, len;
 
-  len = strncaseinitspan (lang, range, rlen);
-  if (len > 0
-      && lang[len] == '\0'
-      && (range[len] == '\0' || range[len] == ' ' || range[len] == '-')
-      && !(len > 2 && range[len-2] == '-'))
-    return len;
+  nsubtags = 0;
+  for (g = 1; g < index->ngroups; g++)
+    for (p = index->groups[g].tag, nsubtags++; *p != '\0'; p++)
+      if (*p == '-')
+	nsubtags++;
+  for (index->nedges = 16; index->nedges < 2 * (unsigned) nsubtags; )
+    index->nedges *= 2;
+  if ((index->trie = xmlMalloc ((nsubtags + 1) * sizeof (int))) == NULL
+      || (index->edges = xmlMalloc (index->nedges
+				    * sizeof (struct trie_edge))) == NULL)
+    return -1;
+  memset (index->edges, 0, index->nedges * sizeof (struct trie_edge));
+  index->trie[0] = -1;
+  nnodes = 1;
+
+  index->longest = 0;
+  len = 0;
+  for (g = 1; g < index->ngroups; g++)
+    {
+      tag = index->groups[g].tag;
+      if ((int) strlen ((const char *) tag) > len)
+	{
+	  index->longest = g;
+	  len = strlen ((const char *) tag);
+	}
+      for (node = 0; ; tag = p + 1)
+	{
+	  for (p = tag; *p != '-' && *p != '\0'; p++)
+	    ;
+	  edge = trie_probe (index, node, tag, p - tag);
+	  if (edge->child == 0)
+	    {
+	      edge->hash = subtag_hash (node, tag, p - tag);
+	      edge->parent = node;
+	      edge->subtag = tag;
+	      edge->len = p - tag;
+	      edge->child = nnodes;
+	      index->trie[nnodes++] = -1;
+	    }
+	  node = edge->child;
+	  if (*p == '\0')
+	    break;
+	}
+      /* tags differing only in case share a node, the first is kept */
+      if (index->trie[node] < 0)
+	index->trie[node] = g;
+    }
   return 0;
 }
 
-struct params
-  {
-    const char *range, *erange;
-    const xmlChar *lang;
-    int last_len;
-  };
+/* Return the group whose language is the longest prefix of the range
+   ending at a subtag which is not a singleton, or 0 */
+static int
+trie_lookup (const struct lang_index *index, const xmlChar *range)
+{
+  const struct trie_edge *edge;
+  const xmlChar *p, *subtag;
+  int node, len, best;
 
-static void
-lang_comp (void *payload _unused, void *data, const xmlChar *lang)
+  best = 0;
+  for (node = 0, subtag = range; ; subtag = p + 1)
+    {
+      for (p = subtag; *p != '-' && *p != '\0'; p++)
+	;
+      edge = trie_probe (index, node, subtag, p - subtag);
+      if ((node = edge->child) == 0)
+	break;
+      len = p - range;
+      if (index->trie[node] >= 0 && len > 0
+	  && !(len > 2 && range[len - 2] == '-'))
+	best = index->trie[node];
+      if (*p == '\0')
+	break;
+    }
+  return best;
+}
+
+/* Return the group of the tag, adding it if necessary, or -1 if memory is
+   exhausted */
+static int
+group_add (struct lang_index *index, const xmlChar *tag)
 {
-  struct params *par = data;
-  int len, rlen;
+  struct lang_group *groups;
+  int *slot, *table;
+  unsigned size, u;
+  int g;
 
-  rlen = par->erange - par->range;
-  if (rlen == 1 && *par->range == '*')
-    len = strlen ((char *) lang);
-  else
-    len = compare_range ((char *) lang, par->range, rlen);
-  if (len > par->last_len)
+  if (*(slot = group_probe (index, tag)) >= 0)
+    return *slot;
+  if (index->ngroups == index->maxgroups)
+    {
+      if ((groups = xmlRealloc (index->groups, 2 * index->maxgroups
+				* sizeof (struct lang_group))) == NULL)
+	return -1;
+      index->groups = groups;
+      index->maxgroups *= 2;
+    }
+  if (2 * (unsigned) index->ngroups > index->size)
     {
-      par->lang = lang;
-      par->last_len = len;
+      size = index->size * 2;
+      if ((table = xmlMalloc (size * sizeof (int))) == NULL)
+	return -1;
+      xmlFree (index->table);
+      index->table = table;
+      index->size = size;
+      for (u = 0; u < size; u++)
+	table[u] = -1;
+      for (g = 1; g < index->ngroups; g++)
+	*group_probe (index, index->groups[g].tag) = g;
+      slot = group_probe (index, tag);
     }
+  g = *slot = index->ngroups++;
+  index->groups[g].tag = tag;
+  index->groups[g].count = 0;
+  return g;
 }
 
-static xmlXPathObject *
-rfc4647_lookup (xmlHashTable *table, const char *lang)
+/* Group the nodes by language.  *cacheable is cleared if any node does
+   not belong to a document whose languages are cached. */
+static struct lang_index *
+lang_index_build (xmlXPathParserContextPtr ctxt, struct lang_ctxt *data,
+		  xmlNodeSet *nodeset, int *cacheable)
 {
-  struct params par;
-  xmlXPathObject *set;
-  char range[64+1], canonic[sizeof range];
-  const char *p;
-  int len;
+  xsltTransformContext *tctxt;
+  struct lang_index *index;
+  const xmlChar *canonic;
+  xmlNode *node;
+  int *group, *next;
+  int i, g;
+  unsigned u;
 
-  memset (&par, 0, sizeof par);
-  while ((len = scan_range (lang, &lang, range, sizeof range)) > 0
-         && (par.range = canonic_tag (canonic, sizeof canonic, range, 1)) != NULL)
+  tctxt = xsltXPathGetTransformContext (ctxt);
+  if ((index = xmlMalloc (sizeof (struct lang_index))) == NULL)
+    return NULL;
+  memset (index, 0, sizeof (struct lang_index));
+  index->nnodes = nodeset->nodeNr;
+  index->size = 16;
+  index->maxgroups = 8;
+  group = NULL;
+  if ((index->nodes = xmlMalloc (nodeset->nodeNr * sizeof (xmlNode *))) == NULL
+      || (index->grouped = xmlMalloc (nodeset->nodeNr * sizeof (xmlNode *)))
+	 == NULL
+      || (index->groups = xmlMalloc (index->maxgroups
+				     * sizeof (struct lang_group))) == NULL
+      || (index->table = xmlMalloc (index->size * sizeof (int))) == NULL
+      || (group = xmlMalloc (nodeset->nodeNr * sizeof (int))) == NULL)
+    goto fail;
+  memcpy (index->nodes, nodeset->nodeTab, nodeset->nodeNr * sizeof (xmlNode *));
+  for (u = 0; u < index->size; u++)
+    index->table[u] = -1;
+  index->groups[0].tag = NULL;
+  index->groups[0].count = 0;
+  index->ngroups = 1;
+
+  for (i = 0; i < nodeset->nodeNr; i++)
     {
-      par.erange = strchr (par.range, '\0');
+      node = nodeset->nodeTab[i];
+      if (node->type == XML_NAMESPACE_DECL || node->doc == NULL
+	  || tctxt == NULL || data == NULL
+	  || lang_doc (tctxt, data, node->doc) == NULL)
+	*cacheable = 0;
+      if (node_lang (ctxt, data, node, &canonic) == NULL)
+	g = 0;
+      else if ((g = group_add (index, canonic)) < 0)
+	goto fail;
+      group[i] = g;
+      index->groups[g].count++;
+    }
 
-      /* probe the table for a preferred exact match (the keys in the
-         table are canonic and the range has just been converted) */
-      if ((set = xmlHashLookup (table, cX canonic)) != NULL)
-        {
-	  xmlHashRemoveEntry (table, cX canonic, NULL);
-	  return set;
-	}
+  /* order the nodes by group keeping their order within each group */
+  if ((next = xmlMalloc (index->ngroups * sizeof (int))) == NULL)
+    goto fail;
+  for (g = 0, i = 0; g < index->ngroups; i += index->groups[g++].count)
+    next[g] = index->groups[g].start = i;
+  for (i = 0; i < nodeset->nodeNr; i++)
+    index->grouped[next[group[i]]++] = nodeset->nodeTab[i];
+  xmlFree (next);
+  xmlFree (group);
+  if (trie_build (index) < 0)
+    {
+      lang_index_free (index);
+      return NULL;
+    }
+  return index;
 
-      /* no exact match, scan the table for the best (longest) match */
-      xmlHashScan (table, lang_comp, &par);
-      if (par.lang != NULL)
-        {
-	  set = xmlHashLookup (table, par.lang);
-	  xmlHashRemoveEntry (table, par.lang, NULL);
-	  return set;
+fail:
+  lang_index_free (index);
+  xmlFree (group);
+  return NULL;
+}
+
+/* Return the language index of the node-set */
+static struct lang_index *
+lang_index (xmlXPathParserContextPtr ctxt, struct lang_ctxt *data,
+	    xmlNodeSet *nodeset, struct lang_index **alloc)
+{
+  struct lang_index *index, **prev, **last;
+  unsigned hash;
+  int n, cacheable;
+
+  *alloc = NULL;
+  hash = nodes_hash (nodeset->nodeTab, nodeset->nodeNr);
+  if (data != NULL)
+    for (prev = &data->indexes; (index = *prev) != NULL; prev = &index->next)
+      if (index->hash == hash && index->nnodes == nodeset->nodeNr
+	  && memcmp (index->nodes, nodeset->nodeTab,
+		     nodeset->nodeNr * sizeof (xmlNode *)) == 0)
+	{
+	  /* move to the front */
+	  *prev = index->next;
+	  index->next = data->indexes;
+	  data->indexes = index;
+	  return index;
 	}
 
+  cacheable = 1;
+  if ((index = lang_index_build (ctxt, data, nodeset, &cacheable)) == NULL)
+    return NULL;
+  index->hash = hash;
+  if (data == NULL || !cacheable)
+    return *alloc = index;
+
+  /* drop the least recently used index */
+  for (n = 1, last = &data->indexes; *last != NULL; last = &(*last)->next)
+    if (n++ == INDEX_CACHE)
+      {
+	lang_index_free (*last);
+	*last = NULL;
+	break;
+      }
+  index->next = data->indexes;
+  data->indexes = index;
+  return index;
+}
+
+/* Return the group whose language best matches the first range in lang
+   which matches any, or 0 */
+static int
+rfc4647_lookup (struct lang_ctxt *data, const struct lang_index *index,
+		const char *lang)
+{
+  char range[64+1];
+  const xmlChar *tag, *canonic;
+  const char *p;
+  int best;
+
+  while (scan_range (lang, &lang, range, sizeof range) > 0
+	 && (tag = tag_intern (data, cX range)) != NULL
+	 && (canonic = tag_canonic (data, tag, 1)) != NULL)
+    {
+      /* probe the table for a preferred exact match (the keys in the
+	 table are canonic and interned as is the range) */
+      if ((best = *group_probe (index, canonic)) >= 0)
+	return best;
+
+      /* no exact match, find the longest match in the trie */
+      if (canonic[0] == '*' && canonic[1] == '\0')
+	best = index->longest;
+      else
+	best = trie_lookup (index, canonic);
+      if (best > 0)
+	return best;
+
       if ((p = strchr (lang, ',')) != NULL)
-        lang = &p[1];
+	lang = &p[1];
       else
 	while (isspace (*lang))
 	  lang++;
     }
-  return NULL;
-}
-
-static void
-free_table (void *payload, const xmlChar *name _unused)
-{
-  xmlXPathObject *obj = payload;
-
-  if (obj != NULL)
-    xmlXPathFreeObject (obj);
+  return 0;
 }
 
 static void
 lang_accept_language (xmlXPathParserContextPtr ctxt, int nargs)
 {
-  xmlNode *node;
-  xmlXPathObject *obj, *set, *default_set;
-  xmlHashTable *table;
-  char *lang;
+  struct lang_ctxt *data;
+  struct lang_index *index, *alloc;
+  const struct lang_group *group;
+  xmlXPathObject *obj, *set;
   char *range;
-  char ctag[256];
   int i;
 
   if (nargs != 2)
@@ -216,46 +954,28 @@ lang_accept_language (xmlXPathParserContextPtr ctxt, int nargs)
       return;
     }
   obj = valuePop (ctxt);
-  if (obj->nodesetval == NULL)
+  set = xmlXPathNewNodeSet (NULL);
+  if (obj->nodesetval == NULL || obj->nodesetval->nodeNr == 0 || set == NULL)
     {
-      valuePush (ctxt, xmlXPathNewNodeSet (NULL));
+      valuePush (ctxt, set);
+      xmlXPathFreeObject (obj);
       xmlFree (range);
       return;
     }
 
-  default_set = xmlXPathNewNodeSet (NULL);
-
-  /* Loop over the nodeset and build subsets for each language tag
-     and store in a hash table. */
-  table = xmlHashCreate (obj->nodesetval->nodeNr);
-  for (i = 0; i < obj->nodesetval->nodeNr; i++)
+  /* Find the nodes grouped by language and pick the group which best
+     matches the range, or the nodes with no language. */
+  data = lang_get_ctxt (ctxt);
+  if ((index = lang_index (ctxt, data, obj->nodesetval, &alloc)) != NULL)
     {
-      node = obj->nodesetval->nodeTab[i];
-      if ((lang = (char *) xmlNodeGetLang (node)) == NULL)
-	set = default_set;
-      else
-	{
-	  if (canonic_tag (ctag, sizeof ctag, lang, 1) == NULL)
-	    strcpy (ctag, lang);
-	  if ((set = xmlHashLookup (table, cX ctag)) == NULL)
-	    {
-	      set = xmlXPathNewNodeSet (NULL);
-	      xmlHashAddEntry (table, cX ctag, set);
-	    }
-	  xmlFree (lang);
-	}
-      xmlXPathNodeSetAddUnique (set->nodesetval, node);
+      group = &index->groups[rfc4647_lookup (data, index, range)];
+      for (i = 0; i < group->count; i++)
+	xmlXPathNodeSetAddUnique (set->nodesetval,
+				  index->grouped[group->start + i]);
     }
+  lang_index_free (alloc);
   xmlXPathFreeObject (obj);
 
-  /* Loop over the available language tags and pick the best match.
-     Remove the entry from the table. Destroy the table. */
-  if (range != NULL && (set = rfc4647_lookup (table, range)) != NULL)
-    xmlXPathFreeObject (default_set);
-  else
-    set = default_set;
-  xmlHashFree (table, free_table);
-
   /* Return the selected node-set */
   valuePush (ctxt, set);
   xmlFree (range);
@@ -268,10 +988,28 @@ lang_accept_language (xmlXPathParserContextPtr ctxt, int nargs)
  * not a valid RFC 4646 tag.
  ****************************************************************************/
 
+/* Push the canonical form of the tag as canonic_tag() finds it, or "" */
+static void
+push_canonic (xmlXPathParserContextPtr ctxt, const char *tag, int full)
+{
+  struct lang_ctxt *data;
+  const xmlChar *interned, *canonic;
+  char ntag[TAG_MAX];
+
+  /* arguments which are not valid tags are not interned */
+  data = lang_get_ctxt (ctxt);
+  canonic = NULL;
+  if ((interned = tag_intern (NULL, cX tag)) != NULL)
+    canonic = tag_canonic (data, interned, full);
+  if (canonic == NULL)
+    canonic = cX canonic_tag (ntag, sizeof ntag, tag, full);
+  valuePush (ctxt, xmlXPathNewString (canonic != NULL ? canonic : cX ""));
+}
+
 static void
 lang_canonic_tag (xmlXPathParserContextPtr ctxt, int nargs)
 {
-  char *tag, ntag[256];
+  char *tag;
 
   if (nargs != 1)
     {
@@ -289,9 +1027,7 @@ lang_canonic_tag (xmlXPathParserContextPtr ctxt, int nargs)
       return;
     }
 
-  if (canonic_tag (ntag, sizeof ntag, tag, 1) == NULL)
-    ntag[0] = '\0';
-  valuePush (ctxt, xmlXPathNewCString (ntag));
+  push_canonic (ctxt, tag, 1);
   xmlFree (tag);
 }
 
@@ -305,7 +1041,7 @@ lang_canonic_tag (xmlXPathParserContextPtr ctxt, int nargs)
 static void
 lang_tag (xmlXPathParserContextPtr ctxt, int nargs)
 {
-  char *tag, ntag[256];
+  char *tag;
 
   if (nargs != 1)
     {
@@ -323,9 +1059,7 @@ lang_tag (xmlXPathParserContextPtr ctxt, int nargs)
       return;
     }
 
-  if (canonic_tag (ntag, sizeof ntag, tag, 0) == NULL)
-    ntag[0] = '\0';
-  valuePush (ctxt, xmlXPathNewCString (ntag));
+  push_canonic (ctxt, tag, 0);
   xmlFree (tag);
 }
 
@@ -380,14 +1114,18 @@ scan_range (const char *s, const char **es, char *buf, size_t buflen)
 void
 xsltLangRegister (void)
 {
+  tags_init ();
+  xsltRegisterExtModuleFull (XSLT_LANG_NAMESPACE,
+			     lang_ctxt_init, lang_ctxt_shutdown, NULL, NULL);
+  stats_init (XSLT_LANG_NAMESPACE);
   /* Tag matching functions */
-  xsltRegisterExtModuleFunction (cX"lang", XSLT_LANG_NAMESPACE, lang_lang);
-  xsltRegisterExtModuleFunction (cX"accept-lang", XSLT_LANG_NAMESPACE,
-  				 lang_accept_language);
+  stats_register_function (cX"lang", XSLT_LANG_NAMESPACE, lang_lang);
+  stats_register_function (cX"accept-lang", XSLT_LANG_NAMESPACE,
+			   lang_accept_language);
   /* Return the canonic version of the tag */
-  xsltRegisterExtModuleFunction (cX"canonic-lang", XSLT_LANG_NAMESPACE,
-  				 lang_canonic_tag);
+  stats_register_function (cX"canonic-lang", XSLT_LANG_NAMESPACE,
+			   lang_canonic_tag);
   /* Extract the language portion of the tag */
-  xsltRegisterExtModuleFunction (cX"extract-lang", XSLT_LANG_NAMESPACE,
-  				 lang_tag);
+  stats_register_function (cX"extract-lang", XSLT_LANG_NAMESPACE,
+			   lang_tag);
 }
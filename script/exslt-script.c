@@ -17,6 +17,7 @@
 
 #include "exslt-script.h"
 #include "script.h"
+#include "stats.h"
 
 #define _unused      __attribute__((unused))
 
@@ -211,7 +212,7 @@ script_comp (xsltStylesheet *style, xmlNode *inst)
 
   /* compile_script() creates a registry for Lua functions accessed by a
      combination of namespace URI and function name.
-     xsltRegisterExtModuleFunction () is called to register
+     stats_register_function () is called to register
      script_function_hook() for each Lua function.  Implementation
      dependent variables are set up when compile_script() is first called
      for a particular scripting language. */
@@ -244,7 +245,7 @@ script_function_hook (xmlXPathParserContextPtr ctxt, int nargs)
 void
 script_register_hook (const char *name, const char *uri)
 {
-  xsltRegisterExtModuleFunction (cX name, cX uri, script_function_hook);
+  stats_register_function (cX name, cX uri, script_function_hook);
 }
 
 
@@ -262,4 +263,5 @@ exslt_script_register (void)
 
   xsltRegisterExtModuleTopLevel ((const xmlChar *) "script",
 				 EXSLT_SCRIPT_NAMESPACE, script_comp);
+  stats_init (EXSLT_SCRIPT_STATS_NAMESPACE);
 }
@@ -18,6 +18,14 @@ extern "C" {
  */
 #define EXSLT_SCRIPT_NAMESPACE (cX"http://exslt.org/functions")
 
+/**
+ * EXSLT_SCRIPT_STATS_NAMESPACE:
+ *
+ * Namespace for the script module's stats() function, which is not part
+ * of EXSLT
+ */
+#define EXSLT_SCRIPT_STATS_NAMESPACE (cX"https://iarthair.github.io/script")
+
 #ifdef MODULE
 #define exslt_script_register exslt_org_functions_init
 #endif